@@ -0,0 +1,334 @@
+/*
+  Character frequency tables
+  Copyright (C) 2012  Morten Hustveit <morten.hustveit@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+
+#include "charset.h"
+
+#define CHARSET_MAX_CODE 0xffff
+
+/* Number of times two characters appeared next to each other */
+struct charset_Pair
+{
+  uint32_t key; /* first << 16 | second, or 0 if unused */
+  unsigned long count;
+};
+
+static unsigned long charset_counts[CHARSET_MAX_CODE + 1];
+
+static struct charset_Pair *charset_pairs;
+static size_t charset_pairCount, charset_pairAlloc;
+
+static struct charset_Pair *
+charset_FindPair (uint32_t key)
+{
+  size_t i;
+
+  i = (key * 2654435761u) & (charset_pairAlloc - 1);
+
+  while (charset_pairs[i].key && charset_pairs[i].key != key)
+    i = (i + 1) & (charset_pairAlloc - 1);
+
+  return &charset_pairs[i];
+}
+
+static void
+charset_AddPair (uint32_t first, uint32_t second)
+{
+  struct charset_Pair *pair;
+
+  /* Key 0 marks unused slots, and a NUL pair is of no interest anyway */
+  if (!first && !second)
+    return;
+
+  if ((charset_pairCount + 1) * 2 > charset_pairAlloc)
+    {
+      struct charset_Pair *oldPairs;
+      size_t i, oldAlloc;
+
+      oldPairs = charset_pairs;
+      oldAlloc = charset_pairAlloc;
+
+      charset_pairAlloc = oldAlloc ? oldAlloc * 2 : 1024;
+
+      if (!(charset_pairs = calloc (charset_pairAlloc, sizeof (*charset_pairs))))
+        err (EXIT_FAILURE, "Failed to allocate character pair table");
+
+      for (i = 0; i < oldAlloc; ++i)
+        {
+          if (oldPairs[i].key)
+            *charset_FindPair (oldPairs[i].key) = oldPairs[i];
+        }
+
+      free (oldPairs);
+    }
+
+  pair = charset_FindPair ((first << 16) | second);
+
+  if (!pair->key)
+    {
+      pair->key = (first << 16) | second;
+      ++charset_pairCount;
+    }
+
+  ++pair->count;
+}
+
+static unsigned long
+charset_PairCount (uint32_t first, uint32_t second)
+{
+  if (!charset_pairAlloc)
+    return 0;
+
+  return charset_FindPair ((first << 16) | second)->count;
+}
+
+/* Returns the next code point in a UTF-8 string, or -1 at end of input.
+ * Malformed sequences are returned as U+FFFD.  */
+static long
+charset_NextUTF8 (FILE *input)
+{
+  int ch, length, i;
+  long result;
+
+  if (EOF == (ch = getc (input)))
+    return -1;
+
+  if (ch < 0x80)
+    return ch;
+  else if ((ch & 0xe0) == 0xc0)
+    length = 1, result = ch & 0x1f;
+  else if ((ch & 0xf0) == 0xe0)
+    length = 2, result = ch & 0x0f;
+  else if ((ch & 0xf8) == 0xf0)
+    length = 3, result = ch & 0x07;
+  else
+    return 0xfffd;
+
+  for (i = 0; i < length; ++i)
+    {
+      if (EOF == (ch = getc (input)))
+        return 0xfffd;
+
+      if ((ch & 0xc0) != 0x80)
+        {
+          ungetc (ch, input);
+
+          return 0xfffd;
+        }
+
+      result = (result << 6) | (ch & 0x3f);
+    }
+
+  return result;
+}
+
+void
+CHARSET_Reset (void)
+{
+  memset (charset_counts, 0, sizeof (charset_counts));
+
+  free (charset_pairs);
+  charset_pairs = NULL;
+  charset_pairCount = 0;
+  charset_pairAlloc = 0;
+}
+
+int
+CHARSET_LoadFrequencies (const char *path)
+{
+  FILE *input;
+  char line[256];
+  unsigned int lineNumber = 0;
+
+  if (!(input = fopen (path, "r")))
+    {
+      warn ("Failed to open `%s' for reading", path);
+
+      return -1;
+    }
+
+  while (fgets (line, sizeof (line), input))
+    {
+      unsigned long code, count;
+      char *start, *endptr;
+
+      ++lineNumber;
+
+      start = line;
+
+      while (isspace ((unsigned char) *start))
+        ++start;
+
+      if (!*start || *start == '#')
+        continue;
+
+      if ((start[0] == 'U' || start[0] == 'u') && start[1] == '+')
+        code = strtoul (start + 2, &endptr, 16);
+      else
+        code = strtoul (start, &endptr, 0);
+
+      if (endptr == start || *endptr != ':')
+        {
+          warnx ("%s:%u: Expected `codepoint:count'", path, lineNumber);
+          fclose (input);
+
+          return -1;
+        }
+
+      start = endptr + 1;
+      count = strtoul (start, &endptr, 0);
+
+      if (endptr == start || (*endptr && !isspace ((unsigned char) *endptr)))
+        {
+          warnx ("%s:%u: Invalid count", path, lineNumber);
+          fclose (input);
+
+          return -1;
+        }
+
+      if (code > CHARSET_MAX_CODE)
+        continue;
+
+      charset_counts[code] += count;
+    }
+
+  if (ferror (input))
+    {
+      warn ("Error reading `%s'", path);
+      fclose (input);
+
+      return -1;
+    }
+
+  fclose (input);
+
+  return 0;
+}
+
+int
+CHARSET_LoadCorpus (const char *path)
+{
+  FILE *input;
+  long ch, prev = -1;
+
+  if (!(input = fopen (path, "r")))
+    {
+      warn ("Failed to open `%s' for reading", path);
+
+      return -1;
+    }
+
+  while (-1 != (ch = charset_NextUTF8 (input)))
+    {
+      if (ch > CHARSET_MAX_CODE)
+        {
+          prev = -1;
+
+          continue;
+        }
+
+      ++charset_counts[ch];
+
+      /* Line breaks and spaces do not produce texture fetches, so they do
+       * not link the characters on either side.  */
+      if (ch == '\n' || ch == ' ' || ch == '\t')
+        {
+          prev = -1;
+
+          continue;
+        }
+
+      if (prev != -1 && prev != ch)
+        charset_AddPair (prev, ch);
+
+      prev = ch;
+    }
+
+  if (ferror (input))
+    {
+      warn ("Error reading `%s'", path);
+      fclose (input);
+
+      return -1;
+    }
+
+  fclose (input);
+
+  return 0;
+}
+
+static int
+charset_CompareFrequency (const void *vlhs, const void *vrhs)
+{
+  uint32_t lhs = *(const uint32_t *) vlhs;
+  uint32_t rhs = *(const uint32_t *) vrhs;
+
+  if (charset_counts[lhs] != charset_counts[rhs])
+    return (charset_counts[lhs] > charset_counts[rhs]) ? -1 : 1;
+
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+void
+CHARSET_Order (uint32_t *codes, size_t count, int colocate)
+{
+  size_t i, j;
+
+  qsort (codes, count, sizeof (*codes), charset_CompareFrequency);
+
+  if (!colocate || !charset_pairCount)
+    return;
+
+  /* Greedily chain each character to the not yet placed character it
+   * most often appears next to.  Ties, and characters with no neighbors
+   * left, fall back to frequency order, which is the order of `codes'.  */
+  for (i = 1; i < count; ++i)
+    {
+      unsigned long best = 0;
+      size_t bestIndex = i;
+      uint32_t tmp;
+
+      for (j = i; j < count; ++j)
+        {
+          unsigned long score;
+
+          score = charset_PairCount (codes[i - 1], codes[j])
+                + charset_PairCount (codes[j], codes[i - 1]);
+
+          if (score > best)
+            {
+              best = score;
+              bestIndex = j;
+            }
+        }
+
+      /* Keep the remainder sorted by frequency */
+      tmp = codes[bestIndex];
+      memmove (&codes[i + 1], &codes[i], (bestIndex - i) * sizeof (*codes));
+      codes[i] = tmp;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef CHARSET_H_
+#define CHARSET_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Forgets all loaded frequencies */
+void
+CHARSET_Reset (void);
+
+/* Reads a table of `codepoint:count' lines.  Codepoints may be decimal,
+ * 0x-prefixed hexadecimal or U+XXXX.  Returns -1 after printing a warning
+ * if the file cannot be read.  */
+int
+CHARSET_LoadFrequencies (const char *path);
+
+/* Counts characters and adjacent character pairs in a UTF-8 text file.
+ * Returns -1 after printing a warning if the file cannot be read.  */
+int
+CHARSET_LoadCorpus (const char *path);
+
+/* Sorts `codes' so that the most frequent characters come first.  With
+ * `colocate', characters that often appear next to each other in the corpus
+ * are kept together.  */
+void
+CHARSET_Order (uint32_t *codes, size_t count, int colocate);
+
+#endif /* !CHARSET_H_ */
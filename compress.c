@@ -0,0 +1,975 @@
+/*
+  Block compression of the atlas
+  Copyright (C) 2012  Morten Hustveit <morten.hustveit@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "compress.h"
+
+/* A range of block rows encoded by one thread */
+struct compress_Job
+{
+  enum COMPRESS_Format format;
+  const uint8_t *rgba;
+  unsigned int width, height;
+  uint8_t *output;
+
+  unsigned int firstRow, endRow;
+
+  struct COMPRESS_Error error;
+
+  pthread_t thread;
+};
+
+static const struct
+{
+  const char *name;
+  unsigned int blockBytes;
+}
+compress_formats[] =
+{
+  { "rgba", 64 },
+  { "bc4",   8 },
+  { "bc7",  16 },
+  { "etc2", 16 }
+};
+
+/* EAC alpha modifiers, indexed by table and pixel index */
+static const int compress_eacModifiers[16][8] =
+{
+  { -3, -6,  -9, -15, 2, 5, 8, 14 },
+  { -3, -7, -10, -13, 2, 6, 9, 12 },
+  { -2, -5,  -8, -13, 1, 4, 7, 12 },
+  { -2, -4,  -6, -13, 1, 3, 5, 12 },
+  { -3, -6,  -8, -12, 2, 5, 7, 11 },
+  { -3, -7,  -9, -11, 2, 6, 8, 10 },
+  { -4, -7,  -8, -11, 3, 6, 7, 10 },
+  { -3, -5,  -8, -11, 2, 4, 7, 10 },
+  { -2, -6,  -8, -10, 1, 5, 7,  9 },
+  { -2, -5,  -8, -10, 1, 4, 7,  9 },
+  { -2, -4,  -8, -10, 1, 3, 7,  9 },
+  { -2, -5,  -7, -10, 1, 4, 6,  9 },
+  { -3, -4,  -7, -10, 2, 3, 6,  9 },
+  { -1, -2,  -3, -10, 0, 1, 2,  9 },
+  { -4, -6,  -8,  -9, 3, 5, 7,  8 },
+  { -3, -5,  -7,  -9, 2, 4, 6,  8 }
+};
+
+/* ETC1 intensity modifiers, indexed by table and pixel index */
+static const int compress_etcModifiers[8][4] =
+{
+  {  2,   8,  -2,   -8 },
+  {  5,  17,  -5,  -17 },
+  {  9,  29,  -9,  -29 },
+  { 13,  42, -13,  -42 },
+  { 18,  60, -18,  -60 },
+  { 24,  80, -24,  -80 },
+  { 33, 106, -33, -106 },
+  { 47, 183, -47, -183 }
+};
+
+static const int compress_bc7Weights[16] =
+{
+  0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64
+};
+
+static unsigned int compress_threads;
+
+int
+COMPRESS_FormatForName (const char *name)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof (compress_formats) / sizeof (compress_formats[0]); ++i)
+    {
+      if (!strcmp (name, compress_formats[i].name))
+        return i;
+    }
+
+  return -1;
+}
+
+const char *
+COMPRESS_FormatName (enum COMPRESS_Format format)
+{
+  return compress_formats[format].name;
+}
+
+void
+COMPRESS_SetThreads (unsigned int count)
+{
+  compress_threads = count;
+}
+
+size_t
+COMPRESS_Size (enum COMPRESS_Format format, unsigned int width,
+               unsigned int height)
+{
+  if (format == COMPRESS_RGBA)
+    return (size_t) width * height * 4;
+
+  return (size_t) ((width + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE)
+         * ((height + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE)
+         * compress_formats[format].blockBytes;
+}
+
+static int
+compress_Clamp (int value)
+{
+  return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+/* Picks the nearest of 8 palette entries for each of 16 values */
+static void
+compress_NearestIndices (const uint8_t values[16], const uint8_t palette[8],
+                         uint8_t indices[16])
+{
+#ifdef __SSE2__
+  __m128i v, best, bestIndex, zero;
+  unsigned int i;
+
+  v = _mm_loadu_si128 ((const __m128i *) values);
+  best = _mm_set1_epi8 ((char) 0xff);
+  bestIndex = _mm_setzero_si128 ();
+  zero = _mm_setzero_si128 ();
+
+  for (i = 0; i < 8; ++i)
+    {
+      __m128i p, distance, notCloser;
+
+      p = _mm_set1_epi8 ((char) palette[i]);
+      distance = _mm_or_si128 (_mm_subs_epu8 (v, p), _mm_subs_epu8 (p, v));
+
+      /* All bits set where distance >= best */
+      notCloser = _mm_cmpeq_epi8 (_mm_subs_epu8 (best, distance), zero);
+
+      bestIndex = _mm_or_si128 (_mm_and_si128 (notCloser, bestIndex),
+                                _mm_andnot_si128 (notCloser, _mm_set1_epi8 (i)));
+      best = _mm_min_epu8 (best, distance);
+    }
+
+  _mm_storeu_si128 ((__m128i *) indices, bestIndex);
+#else
+  unsigned int i, j;
+
+  for (i = 0; i < 16; ++i)
+    {
+      unsigned int best = 256;
+
+      for (j = 0; j < 8; ++j)
+        {
+          unsigned int distance = abs (values[i] - palette[j]);
+
+          if (distance < best)
+            {
+              best = distance;
+              indices[i] = j;
+            }
+        }
+    }
+#endif
+}
+
+static unsigned long
+compress_PaletteError (const uint8_t values[16], const uint8_t palette[8],
+                       const uint8_t indices[16])
+{
+  unsigned long result = 0;
+  unsigned int i;
+
+  for (i = 0; i < 16; ++i)
+    {
+      int d = values[i] - palette[indices[i]];
+
+      result += d * d;
+    }
+
+  return result;
+}
+
+static unsigned long
+compress_EncodeBC4 (const uint8_t values[16], uint8_t *output)
+{
+  uint8_t palette[8], indices[16], bestIndices[16];
+  unsigned int i, lo = 255, hi = 0, innerLo = 255, innerHi = 0;
+  unsigned int e0, e1, best0 = 0, best1 = 0;
+  unsigned long error, bestError = ~0ul;
+  uint64_t bits = 0;
+
+  for (i = 0; i < 16; ++i)
+    {
+      if (values[i] < lo) lo = values[i];
+      if (values[i] > hi) hi = values[i];
+
+      if (values[i] == 0 || values[i] == 255)
+        continue;
+
+      if (values[i] < innerLo) innerLo = values[i];
+      if (values[i] > innerHi) innerHi = values[i];
+    }
+
+  /* Eight interpolated values between the extremes */
+  if (hi > lo)
+    {
+      e0 = hi;
+      e1 = lo;
+
+      palette[0] = e0;
+      palette[1] = e1;
+
+      for (i = 1; i < 7; ++i)
+        palette[i + 1] = ((7 - i) * e0 + i * e1 + 3) / 7;
+
+      compress_NearestIndices (values, palette, indices);
+
+      bestError = compress_PaletteError (values, palette, indices);
+      best0 = e0;
+      best1 = e1;
+      memcpy (bestIndices, indices, sizeof (indices));
+    }
+
+  /* Six interpolated values, plus exact 0 and 255 */
+  if (innerLo > innerHi)
+    innerLo = innerHi = 0;
+
+  e0 = innerLo;
+  e1 = innerHi;
+
+  palette[0] = e0;
+  palette[1] = e1;
+
+  for (i = 1; i < 5; ++i)
+    palette[i + 1] = ((5 - i) * e0 + i * e1 + 2) / 5;
+
+  palette[6] = 0;
+  palette[7] = 255;
+
+  compress_NearestIndices (values, palette, indices);
+
+  if ((error = compress_PaletteError (values, palette, indices)) < bestError)
+    {
+      bestError = error;
+      best0 = e0;
+      best1 = e1;
+      memcpy (bestIndices, indices, sizeof (indices));
+    }
+
+  for (i = 0; i < 16; ++i)
+    bits |= (uint64_t) bestIndices[i] << (3 * i);
+
+  output[0] = best0;
+  output[1] = best1;
+
+  for (i = 0; i < 6; ++i)
+    output[i + 2] = bits >> (8 * i);
+
+  return bestError;
+}
+
+static void
+compress_PutBigEndian64 (uint8_t *output, uint64_t value)
+{
+  unsigned int i;
+
+  for (i = 0; i < 8; ++i)
+    output[i] = value >> (56 - 8 * i);
+}
+
+static unsigned long
+compress_EncodeEAC (const uint8_t values[16], uint8_t *output)
+{
+  uint8_t palette[8], indices[16], bestIndices[16];
+  unsigned int i, lo = 255, hi = 0;
+  unsigned int bestBase, bestMultiplier = 0, bestTable = 0;
+  unsigned long bestError = 0;
+  uint64_t bits;
+
+  for (i = 0; i < 16; ++i)
+    {
+      if (values[i] < lo) lo = values[i];
+      if (values[i] > hi) hi = values[i];
+    }
+
+  /* A multiplier of 0 makes every pixel equal to the base value */
+  bestBase = lo;
+  memset (bestIndices, 0, sizeof (bestIndices));
+
+  if (hi > lo)
+    {
+      unsigned int table;
+
+      bestError = ~0ul;
+
+      for (table = 0; table < 16; ++table)
+        {
+          int min = compress_eacModifiers[table][3];
+          int max = compress_eacModifiers[table][7];
+          int multiplier, center;
+
+          center = ((hi - lo) + (max - min) / 2) / (max - min);
+
+          for (multiplier = center - 1; multiplier <= center + 1; ++multiplier)
+            {
+              int base, baseCenter;
+
+              if (multiplier < 1 || multiplier > 15)
+                continue;
+
+              baseCenter = ((int) (lo + hi) - multiplier * (min + max)) / 2;
+
+              for (base = baseCenter - 1; base <= baseCenter + 1; ++base)
+                {
+                  unsigned long error;
+
+                  if (base < 0 || base > 255)
+                    continue;
+
+                  for (i = 0; i < 8; ++i)
+                    palette[i] = compress_Clamp (base + compress_eacModifiers[table][i] * multiplier);
+
+                  compress_NearestIndices (values, palette, indices);
+
+                  if ((error = compress_PaletteError (values, palette, indices)) < bestError)
+                    {
+                      bestError = error;
+                      bestBase = base;
+                      bestMultiplier = multiplier;
+                      bestTable = table;
+                      memcpy (bestIndices, indices, sizeof (indices));
+                    }
+                }
+            }
+        }
+    }
+
+  bits = (uint64_t) bestBase << 56
+       | (uint64_t) bestMultiplier << 52
+       | (uint64_t) bestTable << 48;
+
+  /* Pixels are stored in column-major order */
+  for (i = 0; i < 16; ++i)
+    bits |= (uint64_t) bestIndices[i] << (45 - 3 * ((i & 3) * 4 + (i >> 2)));
+
+  compress_PutBigEndian64 (output, bits);
+
+  return bestError;
+}
+
+/* Finds the best modifier table for the pixels of one ETC1 subblock */
+static unsigned long
+compress_EncodeETCSubblock (const uint8_t *block, int flip, int subblock,
+                            const int base[3], unsigned int *bestTable,
+                            uint8_t indices[16])
+{
+  unsigned long bestError = ~0ul;
+  unsigned int table, i;
+  uint8_t tableIndices[16];
+
+  for (table = 0; table < 8; ++table)
+    {
+      unsigned long error = 0;
+
+      for (i = 0; i < 16; ++i)
+        {
+          unsigned int k, best = 0;
+          unsigned long pixelError = ~0ul;
+
+          if ((flip ? (i >> 3) : ((i & 3) >> 1)) != subblock)
+            continue;
+
+          for (k = 0; k < 4; ++k)
+            {
+              unsigned long e = 0;
+              unsigned int c;
+
+              for (c = 0; c < 3; ++c)
+                {
+                  int d = compress_Clamp (base[c] + compress_etcModifiers[table][k]) - block[i * 4 + c];
+
+                  e += d * d;
+                }
+
+              if (e < pixelError)
+                {
+                  pixelError = e;
+                  best = k;
+                }
+            }
+
+          tableIndices[i] = best;
+          error += pixelError;
+        }
+
+      if (error < bestError)
+        {
+          bestError = error;
+          *bestTable = table;
+
+          for (i = 0; i < 16; ++i)
+            {
+              if ((flip ? (i >> 3) : ((i & 3) >> 1)) == subblock)
+                indices[i] = tableIndices[i];
+            }
+        }
+    }
+
+  return bestError;
+}
+
+/* Encodes the color part of an ETC2 block, using only the individual and
+ * differential modes shared with ETC1.  */
+static unsigned long
+compress_EncodeETC1 (const uint8_t *block, uint8_t *output)
+{
+  unsigned long bestError = ~0ul;
+  uint64_t bestBits = 0;
+  int flip, differential;
+
+  for (flip = 0; flip < 2; ++flip)
+    {
+      unsigned int average[2][3], i, c;
+
+      memset (average, 0, sizeof (average));
+
+      for (i = 0; i < 16; ++i)
+        {
+          unsigned int subblock = flip ? (i >> 3) : ((i & 3) >> 1);
+
+          for (c = 0; c < 3; ++c)
+            average[subblock][c] += block[i * 4 + c];
+        }
+
+      for (c = 0; c < 3; ++c)
+        {
+          average[0][c] = (average[0][c] + 4) / 8;
+          average[1][c] = (average[1][c] + 4) / 8;
+        }
+
+      for (differential = 0; differential < 2; ++differential)
+        {
+          int quantized[2][3], base[2][3];
+          unsigned int table[2];
+          uint8_t indices[16];
+          unsigned long error;
+          uint64_t bits;
+
+          for (c = 0; c < 3; ++c)
+            {
+              if (differential)
+                {
+                  quantized[0][c] = (average[0][c] * 31 + 127) / 255;
+                  quantized[1][c] = (average[1][c] * 31 + 127) / 255;
+
+                  /* The second color is stored as a 3-bit signed offset */
+                  if (quantized[1][c] < quantized[0][c] - 4)
+                    quantized[1][c] = quantized[0][c] - 4;
+                  else if (quantized[1][c] > quantized[0][c] + 3)
+                    quantized[1][c] = quantized[0][c] + 3;
+
+                  base[0][c] = (quantized[0][c] << 3) | (quantized[0][c] >> 2);
+                  base[1][c] = (quantized[1][c] << 3) | (quantized[1][c] >> 2);
+                }
+              else
+                {
+                  quantized[0][c] = (average[0][c] * 15 + 127) / 255;
+                  quantized[1][c] = (average[1][c] * 15 + 127) / 255;
+
+                  base[0][c] = quantized[0][c] * 17;
+                  base[1][c] = quantized[1][c] * 17;
+                }
+            }
+
+          error = compress_EncodeETCSubblock (block, flip, 0, base[0], &table[0], indices)
+                + compress_EncodeETCSubblock (block, flip, 1, base[1], &table[1], indices);
+
+          if (error >= bestError)
+            continue;
+
+          if (differential)
+            {
+              bits = (uint64_t) quantized[0][0] << 59
+                   | (uint64_t) ((quantized[1][0] - quantized[0][0]) & 7) << 56
+                   | (uint64_t) quantized[0][1] << 51
+                   | (uint64_t) ((quantized[1][1] - quantized[0][1]) & 7) << 48
+                   | (uint64_t) quantized[0][2] << 43
+                   | (uint64_t) ((quantized[1][2] - quantized[0][2]) & 7) << 40;
+            }
+          else
+            {
+              bits = (uint64_t) quantized[0][0] << 60
+                   | (uint64_t) quantized[1][0] << 56
+                   | (uint64_t) quantized[0][1] << 52
+                   | (uint64_t) quantized[1][1] << 48
+                   | (uint64_t) quantized[0][2] << 44
+                   | (uint64_t) quantized[1][2] << 40;
+            }
+
+          bits |= (uint64_t) table[0] << 37
+                | (uint64_t) table[1] << 34
+                | (uint64_t) differential << 33
+                | (uint64_t) flip << 32;
+
+          /* Index MSBs and LSBs in column-major order */
+          for (i = 0; i < 16; ++i)
+            {
+              unsigned int j = (i & 3) * 4 + (i >> 2);
+
+              bits |= (uint64_t) (indices[i] >> 1) << (16 + j)
+                    | (uint64_t) (indices[i] & 1) << j;
+            }
+
+          bestError = error;
+          bestBits = bits;
+        }
+    }
+
+  compress_PutBigEndian64 (output, bestBits);
+
+  return bestError;
+}
+
+static void
+compress_PutBits (uint8_t *output, unsigned int *offset, unsigned int value,
+                  unsigned int count)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; ++i, ++*offset)
+    {
+      if ((value >> i) & 1)
+        output[*offset >> 3] |= 1 << (*offset & 7);
+    }
+}
+
+/* Encodes a BC7 mode 6 block from a pair of unquantized endpoints.  Returns
+ * the squared error, and the weight chosen for each pixel in `weights'.  */
+static unsigned long
+compress_EncodeBC7Endpoints (const uint8_t *block, const double endpoints[2][4],
+                             uint8_t *output, unsigned int weights[16])
+{
+  unsigned int quantized[2][4], pbit[2], palette[16][4], indices[16];
+  unsigned int i, c, offset = 0;
+  unsigned long error = 0;
+
+  /* Each endpoint is 7 bits per channel plus a shared low bit */
+  for (i = 0; i < 2; ++i)
+    {
+      double bestError = 1e30;
+      unsigned int p;
+
+      for (p = 0; p < 2; ++p)
+        {
+          unsigned int q[4];
+          double e = 0;
+
+          for (c = 0; c < 4; ++c)
+            {
+              double d;
+              int v = (int) floor ((endpoints[i][c] - p) / 2 + 0.5);
+
+              q[c] = v < 0 ? 0 : v > 127 ? 127 : v;
+              d = ((q[c] << 1) | p) - endpoints[i][c];
+              e += d * d;
+            }
+
+          if (e < bestError)
+            {
+              bestError = e;
+              pbit[i] = p;
+              memcpy (quantized[i], q, sizeof (q));
+            }
+        }
+    }
+
+  for (i = 0; i < 16; ++i)
+    {
+      for (c = 0; c < 4; ++c)
+        {
+          unsigned int e0 = (quantized[0][c] << 1) | pbit[0];
+          unsigned int e1 = (quantized[1][c] << 1) | pbit[1];
+
+          palette[i][c] = ((64 - compress_bc7Weights[i]) * e0 + compress_bc7Weights[i] * e1 + 32) >> 6;
+        }
+    }
+
+  for (i = 0; i < 16; ++i)
+    {
+      unsigned long bestError = ~0ul;
+      unsigned int k;
+
+      for (k = 0; k < 16; ++k)
+        {
+          unsigned long e = 0;
+
+          for (c = 0; c < 4; ++c)
+            {
+              int d = (int) palette[k][c] - block[i * 4 + c];
+
+              e += d * d;
+            }
+
+          if (e < bestError)
+            {
+              bestError = e;
+              indices[i] = k;
+            }
+        }
+
+      error += bestError;
+      weights[i] = compress_bc7Weights[indices[i]];
+    }
+
+  /* The high bit of the first index is implied to be zero */
+  if (indices[0] & 8)
+    {
+      unsigned int tmp[4];
+
+      memcpy (tmp, quantized[0], sizeof (tmp));
+      memcpy (quantized[0], quantized[1], sizeof (tmp));
+      memcpy (quantized[1], tmp, sizeof (tmp));
+
+      c = pbit[0];
+      pbit[0] = pbit[1];
+      pbit[1] = c;
+
+      for (i = 0; i < 16; ++i)
+        indices[i] = 15 - indices[i];
+    }
+
+  memset (output, 0, 16);
+
+  compress_PutBits (output, &offset, 1 << 6, 7);
+
+  for (c = 0; c < 4; ++c)
+    {
+      compress_PutBits (output, &offset, quantized[0][c], 7);
+      compress_PutBits (output, &offset, quantized[1][c], 7);
+    }
+
+  compress_PutBits (output, &offset, pbit[0], 1);
+  compress_PutBits (output, &offset, pbit[1], 1);
+
+  compress_PutBits (output, &offset, indices[0], 3);
+
+  for (i = 1; i < 16; ++i)
+    compress_PutBits (output, &offset, indices[i], 4);
+
+  return error;
+}
+
+/* Finds the endpoints that minimize the squared error for the given pixel
+ * weights.  Returns -1 if all pixels use the same weight.  */
+static int
+compress_FitBC7Endpoints (const uint8_t *block, const unsigned int weights[16],
+                          double endpoints[2][4])
+{
+  double aa = 0, ab = 0, bb = 0, det;
+  unsigned int i, c;
+
+  for (i = 0; i < 16; ++i)
+    {
+      double b = weights[i] / 64.0, a = 1.0 - b;
+
+      aa += a * a;
+      ab += a * b;
+      bb += b * b;
+    }
+
+  if (fabs (det = aa * bb - ab * ab) < 1e-9)
+    return -1;
+
+  for (c = 0; c < 4; ++c)
+    {
+      double ax = 0, bx = 0;
+
+      for (i = 0; i < 16; ++i)
+        {
+          double b = weights[i] / 64.0, a = 1.0 - b;
+
+          ax += a * block[i * 4 + c];
+          bx += b * block[i * 4 + c];
+        }
+
+      endpoints[0][c] = (bb * ax - ab * bx) / det;
+      endpoints[1][c] = (aa * bx - ab * ax) / det;
+    }
+
+  return 0;
+}
+
+/* Encodes a block in BC7 mode 6, trying endpoints along the principal axis
+ * of the block's colors and at the corners of its bounding box, then
+ * refining the better of the two by least squares.  */
+static unsigned long
+compress_EncodeBC7 (const uint8_t *block, uint8_t *output)
+{
+  double mean[4] = { 0, 0, 0, 0 }, axis[4] = { 1, 1, 1, 1 };
+  double covariance[4][4], endpoints[2][4], tmin = 0, tmax = 0;
+  unsigned long error, bestError;
+  unsigned int weights[16], bestWeights[16];
+  uint8_t candidate[16];
+  unsigned int i, j, c, iteration;
+
+  for (i = 0; i < 16; ++i)
+    for (c = 0; c < 4; ++c)
+      mean[c] += block[i * 4 + c] / 16.0;
+
+  memset (covariance, 0, sizeof (covariance));
+
+  for (i = 0; i < 16; ++i)
+    for (c = 0; c < 4; ++c)
+      for (j = 0; j < 4; ++j)
+        covariance[c][j] += (block[i * 4 + c] - mean[c]) * (block[i * 4 + j] - mean[j]);
+
+  for (iteration = 0; iteration < 8; ++iteration)
+    {
+      double next[4] = { 0, 0, 0, 0 }, length = 0;
+
+      for (c = 0; c < 4; ++c)
+        for (j = 0; j < 4; ++j)
+          next[c] += covariance[c][j] * axis[j];
+
+      for (c = 0; c < 4; ++c)
+        length += next[c] * next[c];
+
+      if (length < 1e-12)
+        break;
+
+      length = sqrt (length);
+
+      for (c = 0; c < 4; ++c)
+        axis[c] = next[c] / length;
+    }
+
+  for (i = 0; i < 16; ++i)
+    {
+      double t = 0;
+
+      for (c = 0; c < 4; ++c)
+        t += (block[i * 4 + c] - mean[c]) * axis[c];
+
+      if (t < tmin) tmin = t;
+      if (t > tmax) tmax = t;
+    }
+
+  for (c = 0; c < 4; ++c)
+    {
+      endpoints[0][c] = mean[c] + tmin * axis[c];
+      endpoints[1][c] = mean[c] + tmax * axis[c];
+    }
+
+  bestError = compress_EncodeBC7Endpoints (block, endpoints, output, bestWeights);
+
+  if (!bestError)
+    return 0;
+
+  for (c = 0; c < 4; ++c)
+    {
+      endpoints[0][c] = 255;
+      endpoints[1][c] = 0;
+
+      for (i = 0; i < 16; ++i)
+        {
+          if (block[i * 4 + c] < endpoints[0][c]) endpoints[0][c] = block[i * 4 + c];
+          if (block[i * 4 + c] > endpoints[1][c]) endpoints[1][c] = block[i * 4 + c];
+        }
+    }
+
+  if ((error = compress_EncodeBC7Endpoints (block, endpoints, candidate, weights)) < bestError)
+    {
+      bestError = error;
+      memcpy (output, candidate, sizeof (candidate));
+      memcpy (bestWeights, weights, sizeof (weights));
+    }
+
+  for (iteration = 0; iteration < 2 && bestError; ++iteration)
+    {
+      if (-1 == compress_FitBC7Endpoints (block, bestWeights, endpoints))
+        break;
+
+      for (c = 0; c < 4; ++c)
+        {
+          endpoints[0][c] = endpoints[0][c] < 0 ? 0 : endpoints[0][c] > 255 ? 255 : endpoints[0][c];
+          endpoints[1][c] = endpoints[1][c] < 0 ? 0 : endpoints[1][c] > 255 ? 255 : endpoints[1][c];
+        }
+
+      if ((error = compress_EncodeBC7Endpoints (block, endpoints, candidate, weights)) >= bestError)
+        break;
+
+      bestError = error;
+      memcpy (output, candidate, sizeof (candidate));
+      memcpy (bestWeights, weights, sizeof (weights));
+    }
+
+  return bestError;
+}
+
+static void *
+compress_Worker (void *arg)
+{
+  struct compress_Job *job = arg;
+  unsigned int blocksPerRow, blockBytes, bx, by, i;
+
+  blocksPerRow = (job->width + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE;
+  blockBytes = compress_formats[job->format].blockBytes;
+
+  for (by = job->firstRow; by < job->endRow; ++by)
+    {
+      for (bx = 0; bx < blocksPerRow; ++bx)
+        {
+          uint8_t block[64], alpha[16], *output;
+          unsigned long error = 0, samples = 16;
+          int empty = 1;
+
+          output = job->output + ((size_t) by * blocksPerRow + bx) * blockBytes;
+
+          /* Blocks crossing the right or bottom edge repeat the last
+           * column or row.  */
+          for (i = 0; i < 16; ++i)
+            {
+              unsigned int x = bx * 4 + (i & 3), y = by * 4 + (i >> 2);
+
+              if (x >= job->width) x = job->width - 1;
+              if (y >= job->height) y = job->height - 1;
+
+              memcpy (block + i * 4, job->rgba + ((size_t) y * job->width + x) * 4, 4);
+            }
+
+          for (i = 0; i < 64; ++i)
+            {
+              if (block[i])
+                empty = 0;
+            }
+
+          for (i = 0; i < 16; ++i)
+            alpha[i] = block[i * 4 + 3];
+
+          switch (job->format)
+            {
+            case COMPRESS_RGBA:
+
+              break;
+
+            case COMPRESS_BC4:
+
+              error = compress_EncodeBC4 (alpha, output);
+
+              break;
+
+            case COMPRESS_BC7:
+
+              error = compress_EncodeBC7 (block, output);
+              samples = 64;
+
+              break;
+
+            case COMPRESS_ETC2:
+
+              error = compress_EncodeEAC (alpha, output)
+                    + compress_EncodeETC1 (block, output + 8);
+              samples = 64;
+
+              break;
+            }
+
+          if (empty)
+            continue;
+
+          job->error.squaredError += error;
+          job->error.samples += samples;
+          ++job->error.blocks;
+        }
+    }
+
+  return NULL;
+}
+
+void
+COMPRESS_Encode (enum COMPRESS_Format format, const uint8_t *rgba,
+                 unsigned int width, unsigned int height, uint8_t *output,
+                 struct COMPRESS_Error *error)
+{
+  struct compress_Job *jobs;
+  unsigned int i, threadCount, rows;
+
+  memset (error, 0, sizeof (*error));
+
+  if (format == COMPRESS_RGBA)
+    {
+      memcpy (output, rgba, (size_t) width * height * 4);
+
+      return;
+    }
+
+  rows = (height + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE;
+
+  if (!(threadCount = compress_threads))
+    {
+      long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+      threadCount = (cpus > 0) ? cpus : 1;
+    }
+
+  if (threadCount > rows)
+    threadCount = rows;
+
+  if (!(jobs = calloc (threadCount, sizeof (*jobs))))
+    err (EXIT_FAILURE, "Failed to allocate %u encoder jobs", threadCount);
+
+  for (i = 0; i < threadCount; ++i)
+    {
+      jobs[i].format = format;
+      jobs[i].rgba = rgba;
+      jobs[i].width = width;
+      jobs[i].height = height;
+      jobs[i].output = output;
+      jobs[i].firstRow = rows * i / threadCount;
+      jobs[i].endRow = rows * (i + 1) / threadCount;
+
+      /* The calling thread takes the first range itself */
+      if (i && (errno = pthread_create (&jobs[i].thread, NULL, compress_Worker, &jobs[i])))
+        err (EXIT_FAILURE, "Failed to start encoder thread");
+    }
+
+  compress_Worker (&jobs[0]);
+
+  for (i = 0; i < threadCount; ++i)
+    {
+      if (i)
+        pthread_join (jobs[i].thread, NULL);
+
+      error->squaredError += jobs[i].error.squaredError;
+      error->samples += jobs[i].error.samples;
+      error->blocks += jobs[i].error.blocks;
+    }
+
+  free (jobs);
+}
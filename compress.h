@@ -0,0 +1,50 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pixel formats of the exported atlas.  The values are stored in the binary
+ * export header.  */
+enum COMPRESS_Format
+{
+  COMPRESS_RGBA = 0, /* uncompressed 32-bit RGBA */
+  COMPRESS_BC4 = 1,  /* coverage only, 8 bytes per 4x4 block */
+  COMPRESS_BC7 = 2,  /* RGBA, 16 bytes per 4x4 block */
+  COMPRESS_ETC2 = 3  /* ETC2 RGBA8, 16 bytes per 4x4 block */
+};
+
+#define COMPRESS_BLOCK_SIZE 4
+
+/* Difference between the encoded atlas and the original */
+struct COMPRESS_Error
+{
+  double squaredError;
+  unsigned long samples; /* channel values compared */
+  unsigned long blocks;  /* non-empty blocks encoded */
+};
+
+/* Returns the format called `name', or -1 if there is none */
+int
+COMPRESS_FormatForName (const char *name);
+
+const char *
+COMPRESS_FormatName (enum COMPRESS_Format format);
+
+/* Sets the number of encoder threads.  0, the default, uses one per CPU.  */
+void
+COMPRESS_SetThreads (unsigned int count);
+
+/* Returns the number of bytes needed to store an image in `format' */
+size_t
+COMPRESS_Size (enum COMPRESS_Format format, unsigned int width,
+               unsigned int height);
+
+/* Encodes an RGBA image.  Images whose dimensions are not multiples of 4,
+ * such as small mip levels, are padded by repeating edge pixels.  */
+void
+COMPRESS_Encode (enum COMPRESS_Format format, const uint8_t *rgba,
+                 unsigned int width, unsigned int height, uint8_t *output,
+                 struct COMPRESS_Error *error);
+
+#endif /* !COMPRESS_H_ */
@@ -15,26 +15,93 @@
   You should have received a copy of the GNU General Public License
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
   */
+#define _POSIX_C_SOURCE 200809L
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <err.h>
 #include <getopt.h>
 #include <locale.h>
+#include <pthread.h>
+#include <unistd.h>
 
+#include "charset.h"
 #include "font.h"
 #include "glyph.h"
+#include "server.h"
+#include "watch.h"
+
+/* Time to wait for an editor to finish saving before rebuilding */
+#define FI_WATCH_QUIET_MS 50
+
+/* Times each --stress-threads thread renders the character set */
+#define FI_STRESS_PASSES 4
 
 static int fi_printVersion;
 static int fi_printHelp;
+static int fi_verbose;
+static unsigned long fi_cacheBytes = 1024 * 1024;
 static const char *fi_fontName = "DejaVu Sans";
 static const char *fi_format = "binary";
 static int fi_fontWeight = 200;
 static int fi_fontSize = 13;
+static int fi_atlasSize; /* 0 until set, so servers can apply their own */
+static int fi_subpixelPositions = 1;
+static int fi_colocate;
+static int fi_pixelFormat = COMPRESS_RGBA;
+static int fi_threads;
+static int fi_mipLevels = 1;
+static int fi_mipFilter = MIPMAP_BOX;
+static const char *fi_servePath;
+static const char *fi_connectPath;
+static int fi_cachedFonts = 16;
+static long fi_glyph = -1;
+static int fi_repeat = 1;
+static const char *fi_outputPath;
+static int fi_watch;
+static int fi_noFontCache;
+static int fi_stressThreads;
+
+/* One font to be packed into the shared atlas */
+struct fi_Job
+{
+  const char *fontName;
+  int fontSize, fontWeight;
+
+  struct FONT_Data *font;
+  unsigned int index;
+
+  /* With --watch, rendered glyphs are kept for rebuilds, indexed by
+   * position in fi_codes and subpixel position.  */
+  struct FONT_Glyph **glyphs;
+};
+
+static struct fi_Job *fi_jobs;
+static size_t fi_jobCount;
+
+/* A --frequency or --corpus file */
+struct fi_Charset
+{
+  const char *path;
+  int corpus;
+};
+
+static struct fi_Charset *fi_charsets;
+static size_t fi_charsetCount;
+
+/* Characters in the atlas in ascending order, and in packing order */
+static uint32_t fi_codes[256], fi_order[256];
+static size_t fi_codeCount;
 
 static struct option long_options[] =
 {
@@ -42,41 +109,605 @@ static struct option long_options[] =
   { "size" ,    required_argument, 0,                's' },
   { "weight" ,  required_argument, 0,                'w' },
   { "format",   required_argument, 0,                'F' },
+  { "atlas-size", required_argument, 0,              'A' },
+  { "subpixel-positions", required_argument, 0,      'P' },
+  { "cache-bytes", required_argument, 0,             'C' },
+  { "frequency", required_argument, 0,               'Q' },
+  { "corpus",    required_argument, 0,               'T' },
+  { "colocate",       no_argument, &fi_colocate,     1 },
+  { "pixel-format", required_argument, 0,            'X' },
+  { "threads",   required_argument, 0,               'J' },
+  { "mip-levels", required_argument, 0,              'M' },
+  { "mip-filter", required_argument, 0,              'K' },
+  { "serve",     required_argument, 0,               'S' },
+  { "cached-fonts", required_argument, 0,            'N' },
+  { "connect",   required_argument, 0,               'c' },
+  { "glyph",     required_argument, 0,               'G' },
+  { "repeat",    required_argument, 0,               'R' },
+  { "output",    required_argument, 0,               'o' },
+  { "watch",          no_argument, &fi_watch,        1 },
+  { "no-font-cache",  no_argument, &fi_noFontCache,  1 },
+  { "stress-threads", required_argument, 0,          'B' },
+  { "verbose",        no_argument, 0,                'v' },
   { "version",        no_argument, &fi_printVersion, 1 },
   { "help",           no_argument, &fi_printHelp,    1 },
   { 0, 0, 0, 0 }
 };
 
-static struct FONT_Data *fi_font;
+static void
+fi_AddJob (const char *fontName)
+{
+  struct fi_Job *job;
+
+  if (!(fi_jobs = realloc (fi_jobs, (fi_jobCount + 1) * sizeof (*fi_jobs))))
+    err (EXIT_FAILURE, "Failed to allocate font job");
+
+  job = &fi_jobs[fi_jobCount++];
+  memset (job, 0, sizeof (*job));
+
+  job->fontName = fontName;
+  job->fontSize = fi_fontSize;
+  job->fontWeight = fi_fontWeight;
+}
+
+static void
+fi_AddCharset (const char *path, int corpus)
+{
+  if (!(fi_charsets = realloc (fi_charsets, (fi_charsetCount + 1) * sizeof (*fi_charsets))))
+    err (EXIT_FAILURE, "Failed to allocate charset list");
+
+  fi_charsets[fi_charsetCount].path = path;
+  fi_charsets[fi_charsetCount].corpus = corpus;
+  ++fi_charsetCount;
+}
+
+/* Sets fi_order from the charset files.  Returns -1 if one of them could
+ * not be read.  */
+static int
+fi_OrderCodes (void)
+{
+  size_t i;
+
+  memcpy (fi_order, fi_codes, fi_codeCount * sizeof (*fi_codes));
+
+  if (!fi_charsetCount)
+    return 0;
+
+  CHARSET_Reset ();
+
+  for (i = 0; i < fi_charsetCount; ++i)
+    {
+      if (-1 == (fi_charsets[i].corpus ? CHARSET_LoadCorpus (fi_charsets[i].path)
+                                       : CHARSET_LoadFrequencies (fi_charsets[i].path)))
+        return -1;
+    }
+
+  /* The packer fills the atlas from the origin, so the most frequent
+   * glyphs end up close together.  */
+  CHARSET_Order (fi_order, fi_codeCount, fi_colocate);
+
+  return 0;
+}
+
+static int
+fi_CompareCode (const void *lhs, const void *rhs)
+{
+  uint32_t a = *(const uint32_t *) lhs, b = *(const uint32_t *) rhs;
+
+  return (a > b) - (a < b);
+}
+
+static int
+fi_LoadJob (struct fi_Job *job)
+{
+  if (!(job->font = FONT_Load (job->fontName, job->fontSize, job->fontWeight)))
+    {
+      warnx ("Failed to load font `%s' of size %u, weight %u", job->fontName, job->fontSize, job->fontWeight);
+
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Adds a glyph from the job's glyph cache, rendering it first if needed */
+static int
+fi_AddCachedGlyph (struct fi_Job *job, uint32_t code)
+{
+  struct FONT_Glyph **glyph;
+  const uint32_t *position;
+  unsigned int variant;
+  int result;
+
+  if (!job->glyphs
+      && !(job->glyphs = calloc (fi_codeCount * fi_subpixelPositions, sizeof (*job->glyphs))))
+    err (EXIT_FAILURE, "Failed to allocate glyph cache");
+
+  position = bsearch (&code, fi_codes, fi_codeCount, sizeof (*fi_codes), fi_CompareCode);
+  glyph = &job->glyphs[(position - fi_codes) * fi_subpixelPositions];
+
+  for (variant = 0; variant < fi_subpixelPositions; ++variant, ++glyph)
+    {
+      if (!*glyph)
+        {
+          if (fi_subpixelPositions == 1)
+            *glyph = FONT_GlyphForCharacter (job->font, code);
+          else
+            *glyph = FONT_GlyphForCharacterAt (job->font, code, variant * 64 / fi_subpixelPositions);
+
+          if (!*glyph)
+            return GLYPH_RENDER_FAILED;
+        }
+
+      if (GLYPH_OK != (result = GLYPH_AddVariant (job->index, code, variant, *glyph)))
+        return result;
+    }
+
+  return GLYPH_OK;
+}
+
+static void
+fi_FreeJob (struct fi_Job *job)
+{
+  size_t i;
+
+  if (job->glyphs)
+    {
+      for (i = 0; i < fi_codeCount * fi_subpixelPositions; ++i)
+        free (job->glyphs[i]);
+
+      free (job->glyphs);
+      job->glyphs = NULL;
+    }
+
+  if (job->font)
+    {
+      FONT_Free (job->font);
+      job->font = NULL;
+    }
+}
+
+/* Packs every job into a new atlas, and exports it to `output'.  Returns
+ * -1 if a glyph could not be added.  */
+static int
+fi_BuildAtlas (FILE *output)
+{
+  size_t j, k;
+  int result;
+
+  GLYPH_Reset ();
+  GLYPH_Init (fi_atlasSize);
+  GLYPH_SetSubpixelPositions (fi_subpixelPositions);
+  GLYPH_SetPixelFormat (fi_pixelFormat);
+  GLYPH_SetMipLevels (fi_mipLevels, fi_mipFilter);
+
+  if (!strcmp (fi_format, "stream"))
+    GLYPH_SetStream (output);
+
+  for (j = 0; j < fi_jobCount; ++j)
+    {
+      struct fi_Job *job = &fi_jobs[j];
+
+      job->index = GLYPH_AddFont (job->font);
+
+      for (k = 0; k < fi_codeCount; ++k)
+        {
+          if (fi_watch)
+            result = fi_AddCachedGlyph (job, fi_order[k]);
+          else
+            result = GLYPH_Load (job->index, job->font, fi_order[k]);
+
+          switch (result)
+            {
+            case GLYPH_RENDER_FAILED:
+
+              warnx ("Failed to get glyph for character %d", (int) fi_order[k]);
+
+              return -1;
+
+            case GLYPH_ATLAS_FULL:
+
+              warnx ("Atlas is full: No room for character %d of `%s'",
+                     (int) fi_order[k], job->fontName);
+
+              return -1;
+            }
+        }
+    }
+
+  GLYPH_Export (fi_format, output);
+
+  return 0;
+}
+
+/* Opens the --output file, or returns stdout.  The file is written under a
+ * temporary name, and renamed by fi_CloseOutput, so readers never see a
+ * partial atlas.  */
+static FILE *
+fi_OpenOutput (char **temporaryPath)
+{
+  FILE *result;
+  int fd;
+
+  *temporaryPath = NULL;
+
+  if (!fi_outputPath)
+    return stdout;
+
+  if (!(*temporaryPath = malloc (strlen (fi_outputPath) + 32)))
+    err (EXIT_FAILURE, "Failed to allocate path");
+
+  sprintf (*temporaryPath, "%s.tmp%ld", fi_outputPath, (long) getpid ());
+
+  if (-1 == (fd = open (*temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0666))
+      || !(result = fdopen (fd, "w")))
+    err (EXIT_FAILURE, "Failed to open `%s' for writing", *temporaryPath);
+
+  return result;
+}
+
+/* Finishes the output, replacing the --output file if `ok' is set.
+ * Returns -1 on failure.  */
+static int
+fi_CloseOutput (FILE *output, char *temporaryPath, int ok)
+{
+  int result = 0, error;
+
+  if (output == stdout)
+    return (EOF == fflush (stdout)) ? -1 : 0;
+
+  error = ferror (output);
+
+  if (EOF == fclose (output) || error)
+    {
+      warn ("Failed to write `%s'", temporaryPath);
+      ok = 0;
+      result = -1;
+    }
+
+  if (!ok)
+    unlink (temporaryPath);
+  else if (-1 == rename (temporaryPath, fi_outputPath))
+    {
+      warn ("Failed to rename `%s' to `%s'", temporaryPath, fi_outputPath);
+      unlink (temporaryPath);
+      result = -1;
+    }
+
+  free (temporaryPath);
 
+  return result;
+}
+
+/* Watches the files of the faces job `j' has used, or, if it has not been
+ * built, every face it may use.  */
 static void
-fi_LoadGlyph (wint_t character)
+fi_WatchJob (size_t j)
+{
+  struct fi_Job *job = &fi_jobs[j];
+  const char *path;
+  char **paths;
+  int i, pathCount;
+
+  WATCH_Remove (j);
+
+  if (job->font)
+    {
+      for (i = 0; (path = FONT_UsedFacePath (job->font, i)); ++i)
+        WATCH_Add (path, j);
+
+      return;
+    }
+
+  if (0 >= (pathCount = FONT_PathsForFont (&paths, job->fontName, job->fontSize, job->fontWeight)))
+    return;
+
+  for (i = 0; i < pathCount; ++i)
+    {
+      WATCH_Add (paths[i], j);
+      free (paths[i]);
+    }
+
+  free (paths);
+}
+
+/* Rebuilds the atlas whenever a font or charset file changes.  Only fonts
+ * using a face whose file changed are rendered again.  */
+static void
+fi_Watch (void)
+{
+  unsigned char *changed;
+  size_t i, j;
+
+  /* The last owner stands for the charset files */
+  if (!(changed = calloc (fi_jobCount + 1, 1)))
+    err (EXIT_FAILURE, "Failed to allocate change list");
+
+  for (i = 0; i < fi_charsetCount; ++i)
+    WATCH_Add (fi_charsets[i].path, fi_jobCount);
+
+  memset (changed, 1, fi_jobCount + 1);
+
+  for (;;)
+    {
+      struct timespec start, end;
+      unsigned int reloaded = 0;
+      char *temporaryPath;
+      FILE *output;
+      int ok = 1, charsetFailed = 0;
+
+      clock_gettime (CLOCK_MONOTONIC, &start);
+
+      if (changed[fi_jobCount] && -1 == fi_OrderCodes ())
+        {
+          ok = 0;
+          charsetFailed = 1;
+        }
+
+      for (j = 0; j < fi_jobCount; ++j)
+        {
+          struct fi_Job *job = &fi_jobs[j];
+
+          if (changed[j])
+            fi_FreeJob (job);
+
+          if (!job->font)
+            {
+              if (-1 == fi_LoadJob (job))
+                ok = 0;
+              else
+                ++reloaded;
+
+              changed[j] = 1;
+            }
+        }
+
+      if (ok)
+        {
+          output = fi_OpenOutput (&temporaryPath);
+          ok = (0 == fi_BuildAtlas (output));
+
+          if (-1 == fi_CloseOutput (output, temporaryPath, ok))
+            ok = 0;
+        }
+
+      /* Which faces a font uses is only known once all of its glyphs have
+       * been rendered.  Until then, any face in its chain may matter.  */
+      for (j = 0; j < fi_jobCount; ++j)
+        {
+          if (!ok && fi_jobs[j].font && changed[j])
+            fi_FreeJob (&fi_jobs[j]);
+
+          if (changed[j] || !fi_jobs[j].font)
+            fi_WatchJob (j);
+        }
+
+      clock_gettime (CLOCK_MONOTONIC, &end);
+
+      if (!ok)
+        fprintf (stderr, "Keeping the previous `%s'\n", fi_outputPath);
+      else if (fi_verbose)
+        {
+          fprintf (stderr, "Wrote `%s' in %.3f ms, rendering %u of %zu fonts\n",
+                   fi_outputPath,
+                   (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) * 1e-6,
+                   reloaded, fi_jobCount);
+        }
+
+      /* A charset file that failed to load is read again by every rebuild,
+       * so none is written until it has been fixed.  */
+      memset (changed, 0, fi_jobCount);
+      changed[fi_jobCount] = charsetFailed;
+
+      WATCH_Wait (changed, fi_jobCount + 1, FI_WATCH_QUIET_MS);
+    }
+}
+
+/* Sends the jobs to a server started with --serve, and writes its reply */
+static void
+fi_Connect (const char *path)
+{
+  struct SERVER_Font *fonts;
+  uint8_t *reply = NULL;
+  size_t size, j;
+  struct timespec start, end;
+  char *temporaryPath;
+  FILE *output;
+  int fd, i;
+
+  if (!(fonts = calloc (fi_jobCount, sizeof (*fonts))))
+    err (EXIT_FAILURE, "Failed to allocate font list");
+
+  for (j = 0; j < fi_jobCount; ++j)
+    {
+      fonts[j].name = fi_jobs[j].fontName;
+      fonts[j].size = fi_jobs[j].fontSize;
+      fonts[j].weight = fi_jobs[j].fontWeight;
+    }
+
+  fd = SERVER_Connect (path);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  /* All requests are sent before the first reply is read */
+  for (i = 0; i < fi_repeat; ++i)
+    {
+      if (fi_glyph >= 0)
+        SERVER_SendGlyphRequest (fd, &fonts[0], fi_glyph);
+      else
+        SERVER_SendAtlasRequest (fd, fi_atlasSize, fonts, fi_jobCount);
+    }
+
+  for (i = 0; i < fi_repeat; ++i)
+    {
+      free (reply);
+
+      if (SERVER_OK != SERVER_ReadResponse (fd, &reply, &size))
+        errx (EXIT_FAILURE, "Server: %s", (const char *) reply);
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  output = fi_OpenOutput (&temporaryPath);
+  fwrite (reply, 1, size, output);
+
+  if (-1 == fi_CloseOutput (output, temporaryPath, 1))
+    exit (EXIT_FAILURE);
+
+  if (fi_verbose)
+    {
+      fprintf (stderr, "%d requests in %.3f ms\n", fi_repeat,
+               (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) * 1e-6);
+    }
+
+  free (reply);
+  free (fonts);
+  close (fd);
+}
+
+/* One --stress-threads thread, with its own render context */
+struct fi_StressThread
+{
+  int cached; /* use the glyph cache instead of subpixel rendering */
+  unsigned long glyphs;
+
+  pthread_t thread;
+};
+
+static void *
+fi_StressWorker (void *arg)
 {
+  struct fi_StressThread *stress = arg;
+  struct FONT_Context *context;
   struct FONT_Glyph *glyph;
+  unsigned int pass, shift;
+  size_t i, j;
+
+  if (!(context = FONT_NewContext ()))
+    errx (EXIT_FAILURE, "Failed to create render context");
+
+  for (pass = 0; pass < FI_STRESS_PASSES; ++pass)
+    {
+      for (j = 0; j < fi_jobCount; ++j)
+        {
+          for (i = 0; i < fi_codeCount; ++i)
+            {
+              if (stress->cached)
+                {
+                  if (!(glyph = FONT_ContextGlyphForCharacter (context, fi_jobs[j].font,
+                                                               fi_codes[i])))
+                    continue;
 
-  if (!(glyph = FONT_GlyphForCharacter (fi_font, character)))
-    errx (EXIT_FAILURE, "Failed to get glyph for character %d", character);
+                  free (glyph);
+                  ++stress->glyphs;
 
-  GLYPH_Add (character, glyph);
+                  continue;
+                }
 
-  free (glyph);
+              for (shift = 0; shift < 64; shift += 16)
+                {
+                  if (!(glyph = FONT_ContextGlyphForCharacterAt (context, fi_jobs[j].font,
+                                                                 fi_codes[i], shift)))
+                    continue;
+
+                  free (glyph);
+                  ++stress->glyphs;
+                }
+            }
+        }
+    }
+
+  FONT_FreeContext (context);
+
+  return NULL;
+}
+
+/* Runs `count' stress threads, and returns their glyphs per second */
+static double
+fi_StressRun (struct fi_StressThread *threads, int count, int cached)
+{
+  struct timespec start, end;
+  unsigned long glyphs;
+  int i;
+
+  memset (threads, 0, count * sizeof (*threads));
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  for (i = 0; i < count; ++i)
+    {
+      threads[i].cached = cached;
+
+      if ((errno = pthread_create (&threads[i].thread, NULL, fi_StressWorker, &threads[i])))
+        err (EXIT_FAILURE, "Failed to start stress thread");
+    }
+
+  for (i = 0, glyphs = 0; i < count; ++i)
+    {
+      pthread_join (threads[i].thread, NULL);
+      glyphs += threads[i].glyphs;
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  return glyphs / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9);
+}
+
+/* Renders the character set of every job on 1, 2, 4, ... up to
+ * fi_stressThreads threads sharing the loaded fonts, and prints the glyph
+ * throughput of each run.  Each thread count is run through the glyph
+ * cache, and again with uncached subpixel rendering.  */
+static void
+fi_Stress (void)
+{
+  struct fi_StressThread *threads;
+  double base[2] = { 0.0, 0.0 }, rate;
+  int count, cached;
+
+  if (!(threads = calloc (fi_stressThreads, sizeof (*threads))))
+    err (EXIT_FAILURE, "Failed to allocate %d stress threads", fi_stressThreads);
+
+  printf ("Threads  Path      Glyphs/s  Speedup\n");
+
+  for (count = 1; ; count = (count * 2 < fi_stressThreads) ? count * 2 : fi_stressThreads)
+    {
+      for (cached = 1; cached >= 0; --cached)
+        {
+          rate = fi_StressRun (threads, count, cached);
+
+          if (count == 1)
+            base[cached] = rate;
+
+          printf ("%7d  %-8s  %8.0f  %6.2fx\n", count, cached ? "cached" : "subpixel",
+                  rate, rate / base[cached]);
+        }
+
+      if (count == fi_stressThreads)
+        break;
+    }
+
+  free (threads);
 }
 
 int
 main (int argc, char **argv)
 {
-  int i;
+  int i, ok;
+  size_t j;
   char *endptr;
+  char *temporaryPath;
+  FILE *output;
 
   setlocale(LC_ALL, "en_US.UTF-8");
 
-  while ((i = getopt_long (argc, argv, "f:s:w:", long_options, 0)) != -1)
+  while ((i = getopt_long (argc, argv, "f:s:w:o:v", long_options, 0)) != -1)
     {
       switch (i)
         {
         case 'f':
 
           fi_fontName = optarg;
+          fi_AddJob (fi_fontName);
 
           break;
 
@@ -90,6 +721,9 @@ main (int argc, char **argv)
           if (fi_fontSize <= 0)
             errx (EXIT_FAILURE, "Invalid size %d.  Expected positive integer", fi_fontSize);
 
+          if (fi_jobCount)
+            fi_jobs[fi_jobCount - 1].fontSize = fi_fontSize;
+
           break;
 
         case 'w':
@@ -102,6 +736,33 @@ main (int argc, char **argv)
           if (fi_fontWeight <= 0)
             errx (EXIT_FAILURE, "Invalid weight %d.  Expected positive integer", fi_fontWeight);
 
+          if (fi_jobCount)
+            fi_jobs[fi_jobCount - 1].fontWeight = fi_fontWeight;
+
+          break;
+
+        case 'A':
+
+          fi_atlasSize = strtol (optarg, &endptr, 0);
+
+          if (*endptr)
+            errx (EXIT_FAILURE, "Invalid atlas size \"%s\".  Expected positive integer", optarg);
+
+          if (fi_atlasSize <= 0 || fi_atlasSize > 32767)
+            errx (EXIT_FAILURE, "Invalid atlas size %d.  Expected integer between 1 and 32767", fi_atlasSize);
+
+          break;
+
+        case 'P':
+
+          fi_subpixelPositions = strtol (optarg, &endptr, 0);
+
+          if (*endptr)
+            errx (EXIT_FAILURE, "Invalid subpixel position count \"%s\".  Expected positive integer", optarg);
+
+          if (fi_subpixelPositions <= 0 || fi_subpixelPositions > 64)
+            errx (EXIT_FAILURE, "Invalid subpixel position count %d.  Expected integer between 1 and 64", fi_subpixelPositions);
+
           break;
 
         case 'F':
@@ -110,6 +771,134 @@ main (int argc, char **argv)
 
           break;
 
+        case 'C':
+
+          fi_cacheBytes = strtoul (optarg, &endptr, 0);
+
+          if (*endptr)
+            errx (EXIT_FAILURE, "Invalid cache size \"%s\".  Expected positive integer", optarg);
+
+          break;
+
+        case 'Q':
+
+          fi_AddCharset (optarg, 0);
+
+          break;
+
+        case 'T':
+
+          fi_AddCharset (optarg, 1);
+
+          break;
+
+        case 'X':
+
+          if (-1 == (fi_pixelFormat = COMPRESS_FormatForName (optarg)))
+            errx (EXIT_FAILURE, "Unknown pixel format \"%s\".  Expected rgba, bc4, bc7 or etc2", optarg);
+
+          break;
+
+        case 'J':
+
+          fi_threads = strtol (optarg, &endptr, 0);
+
+          if (*endptr)
+            errx (EXIT_FAILURE, "Invalid thread count \"%s\".  Expected positive integer", optarg);
+
+          if (fi_threads <= 0)
+            errx (EXIT_FAILURE, "Invalid thread count %d.  Expected positive integer", fi_threads);
+
+          break;
+
+        case 'M':
+
+          fi_mipLevels = strtol (optarg, &endptr, 0);
+
+          if (*endptr)
+            errx (EXIT_FAILURE, "Invalid mip level count \"%s\".  Expected positive integer", optarg);
+
+          if (fi_mipLevels <= 0 || fi_mipLevels > 15)
+            errx (EXIT_FAILURE, "Invalid mip level count %d.  Expected integer between 1 and 15", fi_mipLevels);
+
+          break;
+
+        case 'K':
+
+          if (-1 == (fi_mipFilter = MIPMAP_FilterForName (optarg)))
+            errx (EXIT_FAILURE, "Unknown mip filter \"%s\".  Expected box or kaiser", optarg);
+
+          break;
+
+        case 'S':
+
+          fi_servePath = optarg;
+
+          break;
+
+        case 'N':
+
+          fi_cachedFonts = strtol (optarg, &endptr, 0);
+
+          if (*endptr)
+            errx (EXIT_FAILURE, "Invalid font count \"%s\".  Expected positive integer", optarg);
+
+          if (fi_cachedFonts <= 0)
+            errx (EXIT_FAILURE, "Invalid font count %d.  Expected positive integer", fi_cachedFonts);
+
+          break;
+
+        case 'c':
+
+          fi_connectPath = optarg;
+
+          break;
+
+        case 'G':
+
+          fi_glyph = strtol (optarg, &endptr, 0);
+
+          if (*endptr || fi_glyph < 0 || fi_glyph > 0x10ffff)
+            errx (EXIT_FAILURE, "Invalid code point \"%s\"", optarg);
+
+          break;
+
+        case 'R':
+
+          fi_repeat = strtol (optarg, &endptr, 0);
+
+          if (*endptr)
+            errx (EXIT_FAILURE, "Invalid repeat count \"%s\".  Expected positive integer", optarg);
+
+          if (fi_repeat <= 0)
+            errx (EXIT_FAILURE, "Invalid repeat count %d.  Expected positive integer", fi_repeat);
+
+          break;
+
+        case 'B':
+
+          fi_stressThreads = strtol (optarg, &endptr, 0);
+
+          if (*endptr)
+            errx (EXIT_FAILURE, "Invalid thread count \"%s\".  Expected positive integer", optarg);
+
+          if (fi_stressThreads <= 0)
+            errx (EXIT_FAILURE, "Invalid thread count %d.  Expected positive integer", fi_stressThreads);
+
+          break;
+
+        case 'o':
+
+          fi_outputPath = optarg;
+
+          break;
+
+        case 'v':
+
+          fi_verbose = 1;
+
+          break;
+
         case 0:
 
           break;
@@ -129,9 +918,40 @@ main (int argc, char **argv)
              "  -f, --font=FONT            set font name\n"
              "  -s, --size=SIZE            set font size\n"
              "  -w, --weight=WEIGHT        set font weight\n"
+             "      --format=FORMAT        write binary (default), ktx2, stream or c\n"
+             "      --atlas-size=SIZE      set atlas width and height\n"
+             "      --subpixel-positions=N render each glyph at N fractional x offsets\n"
+             "      --cache-bytes=BYTES    set glyph cache budget\n"
+             "      --frequency=FILE       pack frequent characters first, using a\n"
+             "                             table of `codepoint:count' lines\n"
+             "      --corpus=FILE          pack frequent characters first, counting\n"
+             "                             them in a UTF-8 text file\n"
+             "      --colocate             pack characters that appear next to each\n"
+             "                             other in the corpus close together\n"
+             "      --pixel-format=FORMAT  store the atlas as rgba (default), bc4,\n"
+             "                             bc7 or etc2\n"
+             "      --threads=N            use N threads for block compression\n"
+             "      --mip-levels=N         write N mip levels (ktx2 format only)\n"
+             "      --mip-filter=FILTER    downsample with box (default) or kaiser\n"
+             "      --serve=SOCKET         build atlases on request on a Unix socket\n"
+             "      --cached-fonts=N       keep N loaded fonts between requests\n"
+             "      --connect=SOCKET       request the atlas from a server\n"
+             "      --glyph=CODE           request one glyph instead (with --connect)\n"
+             "      --repeat=N             send N pipelined requests (with --connect)\n"
+             "  -o, --output=FILE          write to FILE instead of standard output\n"
+             "      --watch                rebuild FILE when a font or charset file\n"
+             "                             changes\n"
+             "      --no-font-cache        ask fontconfig for every font, instead of\n"
+             "                             reusing earlier answers\n"
+             "      --stress-threads=N     measure glyph rendering throughput on 1, 2,\n"
+             "                             4, ... up to N threads, instead of importing\n"
+             "  -v, --verbose              print import summary to stderr\n"
              "      --help     display this help and exit\n"
              "      --version  display version information\n"
              "\n"
+             "Each -f adds a font to the shared atlas.  -s and -w apply to the most\n"
+             "recent font, and are inherited by fonts given after it.\n"
+             "\n"
              "Report bugs to <morten.hustveit@gmail.com>\n", argv[0]);
 
       return EXIT_SUCCESS;
@@ -144,21 +964,141 @@ main (int argc, char **argv)
       return EXIT_SUCCESS;
     }
 
-  FONT_Init ();
-  GLYPH_Init ();
+  if (!fi_jobCount)
+    fi_AddJob (fi_fontName);
+
+  if (fi_mipLevels > 1 && strcmp (fi_format, "ktx2"))
+    errx (EXIT_FAILURE, "Mip levels are only written by --format=ktx2");
+
+  if (strcmp (fi_format, "binary") && strcmp (fi_format, "ktx2")
+      && strcmp (fi_format, "stream") && strcmp (fi_format, "c"))
+    errx (EXIT_FAILURE, "Unknown output format '%s'", fi_format);
 
-  if (!(fi_font = FONT_Load (fi_fontName, fi_fontSize, fi_fontWeight)))
-    errx (EXIT_FAILURE, "Failed to load font `%s' of size %u, weight %u", fi_fontName, fi_fontSize, fi_fontWeight);
+  if (fi_watch && (!fi_outputPath || fi_servePath || fi_connectPath))
+    errx (EXIT_FAILURE, "--watch needs --output, and cannot be used with --serve or --connect");
+
+  if (fi_connectPath)
+    {
+      fi_Connect (fi_connectPath);
+
+      return EXIT_SUCCESS;
+    }
+
+  if (!fi_atlasSize)
+    fi_atlasSize = GLYPH_ATLAS_SIZE;
 
   /* ASCII */
   for (i = ' '; i <= '~'; ++i)
-    fi_LoadGlyph (i);
+    fi_codes[fi_codeCount++] = i;
 
   /* ISO-8859-1 */
   for (i = 0xa1; i <= 0xff; ++i)
-    fi_LoadGlyph (i);
+    fi_codes[fi_codeCount++] = i;
+
+  if (!fi_watch && -1 == fi_OrderCodes ())
+    return EXIT_FAILURE;
+
+  FONT_Init ();
+  FONT_SetCacheLimits (4, 4, fi_cacheBytes);
+
+  if (fi_noFontCache)
+    FONT_SetResolutionCache (NULL);
+  COMPRESS_SetThreads (fi_threads);
+
+  if (fi_servePath)
+    {
+      struct SERVER_Options options;
+
+      memset (&options, 0, sizeof (options));
+      options.atlasSize = fi_atlasSize;
+      options.subpixelPositions = fi_subpixelPositions;
+      options.format = fi_format;
+      options.pixelFormat = fi_pixelFormat;
+      options.mipLevels = fi_mipLevels;
+      options.mipFilter = fi_mipFilter;
+      options.codes = fi_order;
+      options.codeCount = fi_codeCount;
+      options.maxFonts = fi_cachedFonts;
+      options.verbose = fi_verbose;
+
+      SERVER_Run (fi_servePath, &options);
+    }
+
+  if (fi_watch)
+    fi_Watch ();
+
+  for (j = 0; j < fi_jobCount; ++j)
+    {
+      if (-1 == fi_LoadJob (&fi_jobs[j]))
+        return EXIT_FAILURE;
+    }
+
+  if (fi_stressThreads)
+    {
+      fi_Stress ();
+
+      return EXIT_SUCCESS;
+    }
+
+  output = fi_OpenOutput (&temporaryPath);
+  ok = (0 == fi_BuildAtlas (output));
+
+  if (-1 == fi_CloseOutput (output, temporaryPath, ok) || !ok)
+    return EXIT_FAILURE;
+
+  if (fi_verbose)
+    {
+      unsigned long hits = 0, misses = 0, uncached = 0, lookupHits, lookupMisses;
+      unsigned int duplicates;
+      size_t bytesSaved;
+      double secondsSaved;
+
+      for (j = 0; j < fi_jobCount; ++j)
+        {
+          unsigned long fontHits, fontMisses, fontUncached;
+
+          FONT_CacheStatistics (fi_jobs[j].font, &fontHits, &fontMisses, &fontUncached);
+
+          hits += fontHits;
+          misses += fontMisses;
+          uncached += fontUncached;
+        }
+
+      GLYPH_DuplicateStatistics (&duplicates, &bytesSaved);
+
+      fprintf (stderr, "Glyph cache: %lu hits, %lu misses (%.1f%% hit ratio)\n",
+               hits, misses,
+               (hits + misses) ? 100.0 * hits / (hits + misses) : 0.0);
 
-  GLYPH_Export (fi_format, stdout);
+      if (uncached)
+        fprintf (stderr, "Subpixel variants: %lu rendered without the cache\n", uncached);
+
+      fprintf (stderr, "Duplicate bitmaps: %u, %zu atlas bytes saved\n",
+               duplicates, bytesSaved);
+
+      FONT_ResolutionStatistics (&lookupHits, &lookupMisses, &secondsSaved);
+
+      fprintf (stderr, "Font lookups: %lu cached, %lu from fontconfig, %.1f ms saved\n",
+               lookupHits, lookupMisses, secondsSaved * 1e3);
+
+      if (fi_pixelFormat != COMPRESS_RGBA)
+        {
+          struct COMPRESS_Error error;
+          double mse;
+
+          GLYPH_CompressionError (&error);
+
+          mse = error.samples ? error.squaredError / error.samples : 0.0;
+
+          fprintf (stderr, "Atlas encoding (%s): %lu blocks, RMSE %.3f, PSNR ",
+                   COMPRESS_FormatName (fi_pixelFormat), error.blocks, sqrt (mse));
+
+          if (mse > 0.0)
+            fprintf (stderr, "%.2f dB\n", 10.0 * log10 (255.0 * 255.0 / mse));
+          else
+            fprintf (stderr, "infinite\n");
+        }
+    }
 
   return EXIT_SUCCESS;
 }
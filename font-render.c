@@ -15,18 +15,55 @@
   You should have received a copy of the GNU General Public License
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
   */
+#include <getopt.h>
+#include <locale.h>
+#include <setjmp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <wchar.h>
 
-#define FR_MAX_GLYPHS 256
+#include <png.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Texture cache model used by the locality benchmark: a fully associative
+ * LRU cache of 4x4 texel tiles, which is how GPUs commonly lay out and cache
+ * RGBA8 textures.  */
+#define FR_CACHE_TILE  4
+#define FR_CACHE_MAX_LINES 4096
+
+/* Default memory for laid out strings in the batch renderer */
+#define FR_LAYOUT_CACHE_BYTES (1024 * 1024)
+
+/* Atlas pixel formats, as stored in the header */
+enum fr_PixelFormat
+{
+  FR_RGBA = 0,
+  FR_BC4 = 1,
+  FR_BC7 = 2,
+  FR_ETC2 = 3
+};
+
+struct fr_FontMetrics
+{
+  int16_t ascent;
+  int16_t descent;
+  int16_t lineHeight;
+  int16_t spaceWidth;
+};
 
 struct fr_GlyphInfo
 {
+  int16_t font;
   int16_t ch;
+  int16_t variant;
   int16_t xOffset;
+  int32_t xAdvance; /* 26.6 fixed point */
   int16_t width;
   int16_t height;
   int16_t x;
@@ -38,10 +75,17 @@ struct fr_GlyphInfo
 struct fr_Font
 {
   int atlasSize;
+  int pixelFormat;
   uint8_t *bitmap;
 
-  struct fr_GlyphInfo glyphs[FR_MAX_GLYPHS];
-  size_t glyphCount;
+  struct fr_FontMetrics *metrics;
+  size_t fontCount;
+
+  /* Number of subpixel positions each glyph is rendered at */
+  int variantCount;
+
+  struct fr_GlyphInfo *glyphs;
+  size_t glyphCount, glyphAlloc;
 };
 
 static int16_t
@@ -55,36 +99,381 @@ fr_ReadS16 (FILE *input)
   return (int16_t) result;
 }
 
+static uint32_t
+fr_ReadU32 (FILE *input)
+{
+  uint32_t result;
+
+  result = (uint16_t) fr_ReadS16 (input);
+  result |= (uint32_t) (uint16_t) fr_ReadS16 (input) << 16;
+
+  return result;
+}
+
+static const int fr_eacModifiers[16][8] =
+{
+  { -3, -6,  -9, -15, 2, 5, 8, 14 },
+  { -3, -7, -10, -13, 2, 6, 9, 12 },
+  { -2, -5,  -8, -13, 1, 4, 7, 12 },
+  { -2, -4,  -6, -13, 1, 3, 5, 12 },
+  { -3, -6,  -8, -12, 2, 5, 7, 11 },
+  { -3, -7,  -9, -11, 2, 6, 8, 10 },
+  { -4, -7,  -8, -11, 3, 6, 7, 10 },
+  { -3, -5,  -8, -11, 2, 4, 7, 10 },
+  { -2, -6,  -8, -10, 1, 5, 7,  9 },
+  { -2, -5,  -8, -10, 1, 4, 7,  9 },
+  { -2, -4,  -8, -10, 1, 3, 7,  9 },
+  { -2, -5,  -7, -10, 1, 4, 6,  9 },
+  { -3, -4,  -7, -10, 2, 3, 6,  9 },
+  { -1, -2,  -3, -10, 0, 1, 2,  9 },
+  { -4, -6,  -8,  -9, 3, 5, 7,  8 },
+  { -3, -5,  -7,  -9, 2, 4, 6,  8 }
+};
+
+static const int fr_etcModifiers[8][4] =
+{
+  {  2,   8,  -2,   -8 },
+  {  5,  17,  -5,  -17 },
+  {  9,  29,  -9,  -29 },
+  { 13,  42, -13,  -42 },
+  { 18,  60, -18,  -60 },
+  { 24,  80, -24,  -80 },
+  { 33, 106, -33, -106 },
+  { 47, 183, -47, -183 }
+};
+
+static const int fr_bc7Weights[16] =
+{
+  0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64
+};
+
+static int
+fr_Clamp (int value)
+{
+  return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+static uint64_t
+fr_BigEndian64 (const uint8_t *data)
+{
+  uint64_t result = 0;
+  unsigned int i;
+
+  for (i = 0; i < 8; ++i)
+    result = (result << 8) | data[i];
+
+  return result;
+}
+
+/* The decoders below write a 4x4 block of RGBA pixels in row-major order */
+
+static void
+fr_DecodeBC4 (const uint8_t *data, uint8_t *block)
+{
+  unsigned int palette[8], e0 = data[0], e1 = data[1], i;
+  uint64_t bits = 0;
+
+  palette[0] = e0;
+  palette[1] = e1;
+
+  if (e0 > e1)
+    {
+      for (i = 1; i < 7; ++i)
+        palette[i + 1] = ((7 - i) * e0 + i * e1 + 3) / 7;
+    }
+  else
+    {
+      for (i = 1; i < 5; ++i)
+        palette[i + 1] = ((5 - i) * e0 + i * e1 + 2) / 5;
+
+      palette[6] = 0;
+      palette[7] = 255;
+    }
+
+  for (i = 0; i < 6; ++i)
+    bits |= (uint64_t) data[i + 2] << (8 * i);
+
+  for (i = 0; i < 16; ++i)
+    memset (block + i * 4, palette[(bits >> (3 * i)) & 7], 4);
+}
+
+static unsigned int
+fr_GetBits (const uint8_t *data, unsigned int *offset, unsigned int count)
+{
+  unsigned int result = 0, i;
+
+  for (i = 0; i < count; ++i, ++*offset)
+    result |= ((data[*offset >> 3] >> (*offset & 7)) & 1) << i;
+
+  return result;
+}
+
+static int
+fr_DecodeBC7 (const uint8_t *data, uint8_t *block)
+{
+  unsigned int endpoints[2][4], pbit[2], i, c, offset = 7;
+
+  /* bm-font-import only writes mode 6 blocks */
+  if ((data[0] & 0x7f) != 0x40)
+    return -1;
+
+  for (c = 0; c < 4; ++c)
+    {
+      endpoints[0][c] = fr_GetBits (data, &offset, 7);
+      endpoints[1][c] = fr_GetBits (data, &offset, 7);
+    }
+
+  pbit[0] = fr_GetBits (data, &offset, 1);
+  pbit[1] = fr_GetBits (data, &offset, 1);
+
+  for (i = 0; i < 16; ++i)
+    {
+      unsigned int index, w;
+
+      index = fr_GetBits (data, &offset, i ? 4 : 3);
+      w = fr_bc7Weights[index];
+
+      for (c = 0; c < 4; ++c)
+        {
+          unsigned int e0 = (endpoints[0][c] << 1) | pbit[0];
+          unsigned int e1 = (endpoints[1][c] << 1) | pbit[1];
+
+          block[i * 4 + c] = ((64 - w) * e0 + w * e1 + 32) >> 6;
+        }
+    }
+
+  return 0;
+}
+
+static int
+fr_DecodeETC2 (const uint8_t *data, uint8_t *block)
+{
+  uint64_t alpha, color;
+  unsigned int base, multiplier, table, i, c;
+  int colors[2][3], tables[2], flip;
+
+  alpha = fr_BigEndian64 (data);
+  color = fr_BigEndian64 (data + 8);
+
+  base = alpha >> 56;
+  multiplier = (alpha >> 52) & 15;
+  table = (alpha >> 48) & 15;
+
+  flip = !!(color & (1ull << 32));
+  tables[0] = (color >> 37) & 7;
+  tables[1] = (color >> 34) & 7;
+
+  for (c = 0; c < 3; ++c)
+    {
+      if (color & (1ull << 33))
+        {
+          int c0 = (color >> (59 - 8 * c)) & 31;
+          int d = (color >> (56 - 8 * c)) & 7;
+          int c1 = c0 + ((d & 4) ? d - 8 : d);
+
+          /* Out of range sums select the T, H and planar modes */
+          if (c1 < 0 || c1 > 31)
+            return -1;
+
+          colors[0][c] = (c0 << 3) | (c0 >> 2);
+          colors[1][c] = (c1 << 3) | (c1 >> 2);
+        }
+      else
+        {
+          colors[0][c] = ((color >> (60 - 8 * c)) & 15) * 17;
+          colors[1][c] = ((color >> (56 - 8 * c)) & 15) * 17;
+        }
+    }
+
+  for (i = 0; i < 16; ++i)
+    {
+      unsigned int j = (i & 3) * 4 + (i >> 2), subblock, k;
+
+      subblock = flip ? (i >> 3) : ((i & 3) >> 1);
+      k = ((color >> (16 + j)) & 1) << 1 | ((color >> j) & 1);
+
+      for (c = 0; c < 3; ++c)
+        block[i * 4 + c] = fr_Clamp (colors[subblock][c] + fr_etcModifiers[tables[subblock]][k]);
+
+      block[i * 4 + 3] = fr_Clamp (base + fr_eacModifiers[table][(alpha >> (45 - 3 * j)) & 7] * multiplier);
+    }
+
+  return 0;
+}
+
+/* Decodes the blocks of a `width' by `height' rectangle at `u', `v' */
+static void
+fr_DecodeBlocks (struct fr_Font *font, int format, unsigned int u,
+                 unsigned int v, unsigned int width, unsigned int height,
+                 FILE *input)
+{
+  unsigned int blockBytes, bx, by, i;
+  uint8_t data[16], block[64];
+
+  blockBytes = (format == FR_BC4) ? 8 : 16;
+
+  for (by = v / 4; by < (v + height) / 4; ++by)
+    {
+      for (bx = u / 4; bx < (u + width) / 4; ++bx)
+        {
+          int result = 0;
+
+          if (blockBytes != fread (data, 1, blockBytes, input))
+            {
+              fprintf (stderr, "Unexpected end of atlas data\n");
+
+              exit (EXIT_FAILURE);
+            }
+
+          switch (format)
+            {
+            case FR_BC4: fr_DecodeBC4 (data, block); break;
+            case FR_BC7: result = fr_DecodeBC7 (data, block); break;
+            case FR_ETC2: result = fr_DecodeETC2 (data, block); break;
+            }
+
+          if (result)
+            {
+              fprintf (stderr, "Unsupported block encoding at block %u,%u\n", bx, by);
+
+              exit (EXIT_FAILURE);
+            }
+
+          for (i = 0; i < 4; ++i)
+            {
+              memcpy (font->bitmap + ((by * 4 + i) * font->atlasSize + bx * 4) * 4,
+                      block + i * 16, 16);
+            }
+        }
+    }
+}
+
+static void
+fr_ReadGlyph (struct fr_GlyphInfo *glyph, FILE *input)
+{
+  glyph->ch =       fr_ReadS16 (input);
+  glyph->variant =  fr_ReadS16 (input);
+  glyph->xOffset =  fr_ReadS16 (input);
+  glyph->xAdvance = (int32_t) fr_ReadU32 (input);
+  glyph->width =    fr_ReadS16 (input);
+  glyph->height =   fr_ReadS16 (input);
+  glyph->x =        fr_ReadS16 (input);
+  glyph->y =        fr_ReadS16 (input);
+  glyph->u =        fr_ReadS16 (input);
+  glyph->v =        fr_ReadS16 (input);
+}
+
 static void
-fr_LoadFont (struct fr_Font *font, FILE *input)
+fr_LoadStream (struct fr_Font *font, FILE *input, int fontIndex,
+               const wchar_t *string);
+
+/* Loads an atlas in the binary or stream format.  Stream loading returns
+ * as soon as every glyph of `string' has arrived, unless it is NULL.  */
+static void
+fr_LoadFont (struct fr_Font *font, FILE *input, int fontIndex,
+             const wchar_t *string)
 {
+  uint8_t magic[4];
+  size_t i;
+  int format;
+
   memset (font, 0, sizeof (*font));
 
-  font->atlasSize = fr_ReadS16 (input);
+  if (4 != fread (magic, 1, 4, input))
+    {
+      fprintf (stderr, "Unexpected end of atlas data\n");
+
+      exit (EXIT_FAILURE);
+    }
+
+  /* No binary atlas can start like this, as it has at most 256 fonts */
+  if (!memcmp (magic, "BMFS", 4))
+    {
+      fr_LoadStream (font, input, fontIndex, string);
+
+      return;
+    }
+
+  font->atlasSize = (int16_t) (magic[0] | magic[1] << 8);
+  font->fontCount = (int16_t) (magic[2] | magic[3] << 8);
+  font->variantCount = fr_ReadS16 (input);
+  format = fr_ReadS16 (input);
+
+  font->metrics = calloc (font->fontCount, sizeof (*font->metrics));
+
+  for (i = 0; i < font->fontCount; ++i)
+    {
+      font->metrics[i].ascent =     fr_ReadS16 (input);
+      font->metrics[i].descent =    fr_ReadS16 (input);
+      font->metrics[i].lineHeight = fr_ReadS16 (input);
+      font->metrics[i].spaceWidth = fr_ReadS16 (input);
+    }
 
   font->bitmap = calloc (4, font->atlasSize * font->atlasSize);
 
-  fread (font->bitmap, 4, font->atlasSize * font->atlasSize, input);
+  switch (format)
+    {
+    case FR_RGBA:
+
+      fread (font->bitmap, 4, font->atlasSize * font->atlasSize, input);
+
+      break;
+
+    case FR_BC4:
+    case FR_BC7:
+    case FR_ETC2:
+
+      fr_DecodeBlocks (font, format, 0, 0, font->atlasSize, font->atlasSize, input);
+
+      break;
+
+    default:
+
+      fprintf (stderr, "Unknown atlas pixel format %d\n", format);
+
+      exit (EXIT_FAILURE);
+    }
 
-  while (!feof (input) && font->glyphCount < FR_MAX_GLYPHS)
+  for (;;)
     {
       struct fr_GlyphInfo glyph;
 
-      glyph.ch =      fr_ReadS16 (input);
-      glyph.xOffset = fr_ReadS16 (input);
-      glyph.width =   fr_ReadS16 (input);
-      glyph.height =  fr_ReadS16 (input);
-      glyph.x =       fr_ReadS16 (input);
-      glyph.y =       fr_ReadS16 (input);
-      glyph.u =       fr_ReadS16 (input);
-      glyph.v =       fr_ReadS16 (input);
+      glyph.font =     fr_ReadS16 (input);
+
+      if (feof (input))
+        break;
+
+      fr_ReadGlyph (&glyph, input);
+
+      if (font->glyphCount == font->glyphAlloc)
+        {
+          font->glyphAlloc = font->glyphAlloc ? font->glyphAlloc * 2 : 256;
+          font->glyphs = realloc (font->glyphs, font->glyphAlloc * sizeof (*font->glyphs));
+        }
 
       font->glyphs[font->glyphCount++] = glyph;
     }
 }
 
+/* Glyphs are stored sorted by font index, character and variant */
+static int
+fr_CompareGlyph (const struct fr_GlyphInfo *glyph, int fontIndex, wint_t ch,
+                 int variant)
+{
+  if (glyph->font != fontIndex)
+    return glyph->font < fontIndex ? -1 : 1;
+
+  if (glyph->ch != ch)
+    return glyph->ch < ch ? -1 : 1;
+
+  if (glyph->variant != variant)
+    return glyph->variant < variant ? -1 : 1;
+
+  return 0;
+}
+
 static struct fr_GlyphInfo *
-fr_FindGlyph (struct fr_Font *font, wint_t ch)
+fr_FindGlyph (struct fr_Font *font, int fontIndex, wint_t ch, int variant)
 {
   size_t first = 0, half, middle, count;
 
@@ -92,13 +481,15 @@ fr_FindGlyph (struct fr_Font *font, wint_t ch)
 
   while (count > 0)
     {
+      int cmp;
+
       half = count / 2;
       middle = first + half;
 
-      if (font->glyphs[middle].ch == ch)
+      if (!(cmp = fr_CompareGlyph (&font->glyphs[middle], fontIndex, ch, variant)))
         return &font->glyphs[middle];
 
-      if (font->glyphs[middle].ch < ch)
+      if (cmp < 0)
         {
           first = middle + 1;
           count -= half + 1;
@@ -110,146 +501,1854 @@ fr_FindGlyph (struct fr_Font *font, wint_t ch)
   return NULL;
 }
 
+/* Adds a glyph, keeping the list sorted */
 static void
-fr_PutRGB (uint8_t *rgb)
+fr_InsertGlyph (struct fr_Font *font, const struct fr_GlyphInfo *glyph)
 {
-  static const char intensity[] = "%@&#$=+<;:-. ";
-  static const struct
+  size_t first = 0, count = font->glyphCount;
+
+  while (count > 0)
     {
-      uint8_t r, g, b;
-      const char *str;
+      size_t half = count / 2;
+
+      if (fr_CompareGlyph (&font->glyphs[first + half], glyph->font, glyph->ch,
+                           glyph->variant) < 0)
+        {
+          first += half + 1;
+          count -= half + 1;
+        }
+      else
+        count = half;
     }
-  palette[] =
-    {
-        { 0x00, 0x00, 0x00, "\033[23;30m" },
-        { 0x18, 0x18, 0xc2, "\033[23;34m" },
-        { 0x18, 0xc2, 0x18, "\033[23;32m" },
-        { 0x18, 0xc2, 0xc2, "\033[23;36m" },
-        { 0xc2, 0x18, 0x18, "\033[23;31m" },
-        { 0xc2, 0x18, 0xc2, "\033[23;35m" },
-        { 0xc2, 0xc2, 0x18, "\033[23;33m" },
-        { 0xc2, 0xc2, 0xc2, "\033[23;37m" },
-        { 0x68, 0x68, 0x68, "\033[3;30m" },
-        { 0x74, 0x74, 0xff, "\033[3;34m" },
-        { 0x54, 0xff, 0x54, "\033[3;32m" },
-        { 0x54, 0xff, 0xff, "\033[3;36m" },
-        { 0xff, 0x54, 0x54, "\033[3;31m" },
-        { 0xff, 0x54, 0xff, "\033[3;35m" },
-        { 0xff, 0xff, 0x54, "\033[3;33m" },
-        { 0xff, 0xff, 0xff, "\033[3;37m" }
-    };
 
-  uint8_t r, g, b;
-  unsigned int nearest = 0, nearestScore = 768, i;
+  if (first < font->glyphCount
+      && !fr_CompareGlyph (&font->glyphs[first], glyph->font, glyph->ch, glyph->variant))
+    {
+      font->glyphs[first] = *glyph;
 
-  r = rgb[0];
-  g = rgb[1];
-  b = rgb[2];
+      return;
+    }
 
-  for (i = 0; i < sizeof (palette) / sizeof (palette[0]); ++i)
+  if (font->glyphCount == font->glyphAlloc)
     {
-      unsigned int score, dr, dg, db;
+      font->glyphAlloc = font->glyphAlloc ? font->glyphAlloc * 2 : 256;
+      font->glyphs = realloc (font->glyphs, font->glyphAlloc * sizeof (*font->glyphs));
+    }
 
-      if (r > palette[i].r || g > palette[i].g || b > palette[i].b)
-        continue;
+  memmove (&font->glyphs[first + 1], &font->glyphs[first],
+           (font->glyphCount - first) * sizeof (*font->glyphs));
+  font->glyphs[first] = *glyph;
+  ++font->glyphCount;
+}
 
-      dr = (palette[i].r - r);
-      dg = (palette[i].g - g);
-      db = (palette[i].b - b);
+static void
+fr_StreamError (const char *message)
+{
+  fprintf (stderr, "Malformed atlas stream: %s\n", message);
 
-      score = (dr > dg && dr > db) ? dr
-            : (dg > db) ? dg
-            : db;
+  exit (EXIT_FAILURE);
+}
 
-      if (score < nearestScore)
-        {
-          nearest = i;
-          nearestScore = score;
-        }
+static void
+fr_ReadTile (struct fr_Font *font, uint32_t length, FILE *input)
+{
+  unsigned int u, v, width, height, y;
+  size_t size;
+
+  if (!font->bitmap || length < 8)
+    fr_StreamError ("tile before header");
+
+  u = (uint16_t) fr_ReadS16 (input);
+  v = (uint16_t) fr_ReadS16 (input);
+  width = (uint16_t) fr_ReadS16 (input);
+  height = (uint16_t) fr_ReadS16 (input);
+
+  if (u + width > font->atlasSize || v + height > font->atlasSize)
+    fr_StreamError ("tile outside the atlas");
+
+  if (font->pixelFormat == FR_RGBA)
+    size = (size_t) width * height * 4;
+  else
+    size = (size_t) width * height / 16 * ((font->pixelFormat == FR_BC4) ? 8 : 16);
+
+  if (length != 8 + size)
+    fr_StreamError ("wrong tile size");
+
+  if (font->pixelFormat != FR_RGBA)
+    {
+      if ((u | v | width | height) & 3)
+        fr_StreamError ("tile is not block aligned");
+
+      fr_DecodeBlocks (font, font->pixelFormat, u, v, width, height, input);
+
+      return;
     }
 
-  printf ("%s%c", palette[nearest].str, intensity[nearestScore * (sizeof (intensity) - 1) / 256]);
+  for (y = 0; y < height; ++y)
+    {
+      if (width != fread (font->bitmap + ((v + y) * font->atlasSize + u) * 4, 4, width, input))
+        fr_StreamError ("truncated tile");
+    }
 }
 
-static void
-fr_RenderString (struct fr_Font *font, const char *string)
+/* Stream chunks the reader cares about */
+enum fr_Chunk
 {
-  const char *ch;
-  unsigned char *target;
-  unsigned int x, y, width, height;
-  int left = 0, right = 0, top = 0, bottom = 0;
+  FR_CHUNK_END,
+  FR_CHUNK_GLYPH,
+  FR_CHUNK_OTHER
+};
 
-  for (x = 0, ch = string; *ch; ++ch)
-    {
-      struct fr_GlyphInfo *glyph;
+static enum fr_Chunk
+fr_ReadChunk (struct fr_Font *font, FILE *input)
+{
+  struct fr_GlyphInfo glyph;
+  char type[4];
+  uint32_t length;
+  int index;
 
-      if (!(glyph = fr_FindGlyph (font, *ch)))
-        continue;
+  length = fr_ReadU32 (input);
 
-      if (x - glyph->x < left)
-        left = glyph->x;
+  if (4 != fread (type, 1, 4, input))
+    fr_StreamError ("unexpected end of data");
 
-      if (x + glyph->width - glyph->x > right)
-        right = x + glyph->width - glyph->x;
+  if (!memcmp (type, "END ", 4))
+    return FR_CHUNK_END;
 
-      if (-glyph->y < top)
-        top = -glyph->y;
+  if (!memcmp (type, "HEAD", 4) && length == 6)
+    {
+      font->atlasSize = fr_ReadS16 (input);
+      font->variantCount = fr_ReadS16 (input);
+      font->pixelFormat = fr_ReadS16 (input);
 
-      if (glyph->height - glyph->y > bottom)
-        bottom = glyph->height - glyph->y;
+      if (font->atlasSize <= 0 || font->variantCount <= 0 || font->bitmap
+          || font->pixelFormat < FR_RGBA || font->pixelFormat > FR_ETC2)
+        fr_StreamError ("bad header");
 
-      x += glyph->xOffset;
+      font->bitmap = calloc (4, font->atlasSize * font->atlasSize);
     }
+  else if (!memcmp (type, "FONT", 4) && length == 10)
+    {
+      if (0 > (index = fr_ReadS16 (input)))
+        fr_StreamError ("bad font index");
 
-  width = right - left;
-  height = bottom - top;
-
-  target = calloc (4, width * height);
+      if ((size_t) index >= font->fontCount)
+        {
+          font->metrics = realloc (font->metrics, (index + 1) * sizeof (*font->metrics));
+          memset (font->metrics + font->fontCount, 0,
+                  (index + 1 - font->fontCount) * sizeof (*font->metrics));
+          font->fontCount = index + 1;
+        }
 
-  for (x = 0, ch = string; *ch; ++ch)
+      font->metrics[index].ascent =     fr_ReadS16 (input);
+      font->metrics[index].descent =    fr_ReadS16 (input);
+      font->metrics[index].lineHeight = fr_ReadS16 (input);
+      font->metrics[index].spaceWidth = fr_ReadS16 (input);
+    }
+  else if (!memcmp (type, "GLYF", 4) && length == 24)
     {
-      struct fr_GlyphInfo *glyph;
-      unsigned int row;
+      glyph.font = fr_ReadS16 (input);
+      fr_ReadGlyph (&glyph, input);
 
-      if (!(glyph = fr_FindGlyph (font, *ch)))
-        continue;
+      if (glyph.font < 0 || (size_t) glyph.font >= font->fontCount)
+        fr_StreamError ("glyph of unknown font");
 
-      y = -glyph->y - top;
+      fr_InsertGlyph (font, &glyph);
 
-      for (row = 0; row < glyph->height; ++row, ++y)
+      return FR_CHUNK_GLYPH;
+    }
+  else if (!memcmp (type, "TILE", 4))
+    fr_ReadTile (font, length, input);
+  else
+    {
+      /* Unknown chunk types are skipped */
+      for (; length; --length)
         {
-          memcpy (target + (y * width + x - glyph->x) * 4,
-                  font->bitmap + ((glyph->v + row) * font->atlasSize + glyph->u) * 4,
-                  glyph->width * 4);
+          if (EOF == getc (input))
+            break;
         }
+    }
+
+  if (feof (input))
+    fr_StreamError ("unexpected end of data");
+
+  return FR_CHUNK_OTHER;
+}
+
+/* Returns non-zero if every glyph of `string' has been loaded */
+static int
+fr_HasGlyphs (struct fr_Font *font, int fontIndex, const wchar_t *string)
+{
+  int variant;
 
-      x += glyph->xOffset;
+  if (fontIndex < 0 || (size_t) fontIndex >= font->fontCount)
+    return 0;
+
+  for (; *string; ++string)
+    {
+      if (*string == ' ')
+        continue;
+
+      for (variant = 0; variant < font->variantCount; ++variant)
+        {
+          if (!fr_FindGlyph (font, fontIndex, *string, variant))
+            return 0;
+        }
     }
 
-  for (y = 0; y < height; ++y)
+  return 1;
+}
+
+static void
+fr_LoadStream (struct fr_Font *font, FILE *input, int fontIndex,
+               const wchar_t *string)
+{
+  enum fr_Chunk chunk = FR_CHUNK_OTHER;
+
+  /* A glyph's tile is sent right after its record, so glyphs are only
+   * complete once the next chunk is something else.  */
+  for (;;)
     {
-      for (x = 0; x < width; ++x)
-        fr_PutRGB (&target[(y * width + x) * 4]);
+      if (string && chunk != FR_CHUNK_GLYPH && fr_HasGlyphs (font, fontIndex, string))
+        return;
 
-      putchar ('\n');
+      if (FR_CHUNK_END == (chunk = fr_ReadChunk (font, input)))
+        break;
     }
+
+  if (!font->bitmap)
+    fr_StreamError ("no header");
 }
 
-int
-main (int argc, char **argv)
+/* Returns the glyph for `ch' in the variant nearest to the pen position,
+ * which is kept in 26.6 fixed point, and advances the pen past it.  `x'
+ * receives the pixel position to draw the glyph at.  */
+static struct fr_GlyphInfo *
+fr_NextGlyph (struct fr_Font *font, int fontIndex, int *pen, wint_t ch, int *x)
 {
-  struct fr_Font font;
+  struct fr_GlyphInfo *glyph;
+  int variant;
+
+  *x = *pen >> 6;
+  variant = ((*pen & 63) * font->variantCount + 32) >> 6;
+
+  if (variant == font->variantCount)
+    {
+      variant = 0;
+      ++*x;
+    }
 
-  if (argc != 2)
+  if (!(glyph = fr_FindGlyph (font, fontIndex, ch, variant)))
     {
-      fprintf (stderr, "Usage: %s <STRING>\n", argv[0]);
+      if (ch == ' ')
+        *pen += font->metrics[fontIndex].spaceWidth << 6;
 
-      return EXIT_FAILURE;
+      return NULL;
     }
 
-  fr_LoadFont (&font, stdin);
+  *pen += glyph->xAdvance;
+
+  return glyph;
+}
+
+/* A glyph of a laid out string: its position relative to the top left
+ * corner of the string's bounding box, and its rectangle in the atlas.  */
+struct fr_PlacedGlyph
+{
+  int32_t x, y;
+  uint16_t u, v, width, height;
+};
+
+struct fr_Layout
+{
+  unsigned int width, height;
+
+  const struct fr_PlacedGlyph *glyphs;
+  unsigned int glyphCount;
+};
+
+/* Laid out strings, stored in an arena of fixed size.  When it fills up,
+ * the least recently used layouts are evicted and the rest are moved
+ * together.  */
+struct fr_LayoutEntry
+{
+  uint64_t hash;
+  int fontIndex;
+
+  /* The string, then the glyphs, start at `offset' in the arena */
+  size_t offset, size;
+  uint32_t length;
+
+  unsigned int width, height, glyphCount;
+
+  int next;          /* in the hash bucket, or the free list */
+  int newer, older;  /* in the LRU list */
+};
+
+struct fr_LayoutCache
+{
+  uint8_t *arena;
+  size_t arenaSize, arenaUsed, liveBytes;
+
+  struct fr_LayoutEntry *entries;
+  int entryAlloc, freeEntry;
+
+  int *buckets;
+  uint64_t bucketMask;
+
+  int newest, oldest;
+
+  unsigned long hits, misses, evictions;
+
+  /* Scratch space for laying out strings */
+  struct fr_PlacedGlyph *placed;
+  size_t placedAlloc;
+};
+
+static uint64_t
+fr_HashString (int fontIndex, const wchar_t *string, size_t length)
+{
+  uint64_t hash = 0xcbf29ce484222325ull ^ (uint32_t) fontIndex;
+  size_t i;
+
+  for (i = 0; i < length; ++i)
+    hash = (hash ^ (uint32_t) string[i]) * 0x100000001b3ull;
+
+  return hash;
+}
+
+static size_t
+fr_LayoutKeySize (size_t length)
+{
+  /* Keeps the glyphs that follow the string aligned */
+  return (length * sizeof (wchar_t) + 7) & ~(size_t) 7;
+}
+
+static void
+fr_InitLayoutCache (struct fr_LayoutCache *cache, size_t size)
+{
+  size_t bucketCount = 64, i;
+
+  memset (cache, 0, sizeof (*cache));
+
+  cache->arenaSize = size;
+  cache->freeEntry = -1;
+  cache->newest = -1;
+  cache->oldest = -1;
+
+  if (!size)
+    return;
+
+  /* A typical label takes a few hundred bytes */
+  while (bucketCount * 256 < size)
+    bucketCount *= 2;
+
+  if (!(cache->arena = malloc (size))
+      || !(cache->buckets = malloc (bucketCount * sizeof (*cache->buckets))))
+    {
+      fprintf (stderr, "Failed to allocate %zu byte layout cache\n", size);
+
+      exit (EXIT_FAILURE);
+    }
+
+  for (i = 0; i < bucketCount; ++i)
+    cache->buckets[i] = -1;
+
+  cache->bucketMask = bucketCount - 1;
+}
+
+static void
+fr_UnlinkLayout (struct fr_LayoutCache *cache, int index)
+{
+  struct fr_LayoutEntry *entry = &cache->entries[index];
+
+  if (entry->newer != -1)
+    cache->entries[entry->newer].older = entry->older;
+  else
+    cache->newest = entry->older;
+
+  if (entry->older != -1)
+    cache->entries[entry->older].newer = entry->newer;
+  else
+    cache->oldest = entry->newer;
+}
+
+static void
+fr_LinkNewestLayout (struct fr_LayoutCache *cache, int index)
+{
+  struct fr_LayoutEntry *entry = &cache->entries[index];
+
+  entry->newer = -1;
+  entry->older = cache->newest;
+
+  if (cache->newest != -1)
+    cache->entries[cache->newest].newer = index;
+  else
+    cache->oldest = index;
+
+  cache->newest = index;
+}
+
+static void
+fr_EvictLayout (struct fr_LayoutCache *cache)
+{
+  struct fr_LayoutEntry *entry;
+  int index = cache->oldest, *link;
+
+  entry = &cache->entries[index];
+
+  for (link = &cache->buckets[entry->hash & cache->bucketMask];
+       *link != index; link = &cache->entries[*link].next)
+    ;
+
+  *link = entry->next;
+
+  fr_UnlinkLayout (cache, index);
+
+  cache->liveBytes -= entry->size;
+  ++cache->evictions;
+
+  entry->next = cache->freeEntry;
+  cache->freeEntry = index;
+}
+
+static int
+fr_CompareOffsets (const void *vlhs, const void *vrhs)
+{
+  const struct fr_LayoutEntry *lhs = *(const struct fr_LayoutEntry * const *) vlhs;
+  const struct fr_LayoutEntry *rhs = *(const struct fr_LayoutEntry * const *) vrhs;
+
+  return (lhs->offset > rhs->offset) - (lhs->offset < rhs->offset);
+}
+
+/* Moves the remaining layouts to the start of the arena, in order */
+static void
+fr_CompactLayouts (struct fr_LayoutCache *cache)
+{
+  struct fr_LayoutEntry **live;
+  size_t count = 0, offset = 0, i;
+  int index;
+
+  if (!(live = malloc (cache->entryAlloc * sizeof (*live))))
+    {
+      fprintf (stderr, "Failed to allocate layout list\n");
+
+      exit (EXIT_FAILURE);
+    }
+
+  for (index = cache->newest; index != -1; index = cache->entries[index].older)
+    live[count++] = &cache->entries[index];
+
+  qsort (live, count, sizeof (*live), fr_CompareOffsets);
+
+  for (i = 0; i < count; ++i)
+    {
+      memmove (cache->arena + offset, cache->arena + live[i]->offset, live[i]->size);
+      live[i]->offset = offset;
+      offset += live[i]->size;
+    }
+
+  cache->arenaUsed = offset;
+
+  free (live);
+}
+
+/* Stores the layout in `cache->placed' in the arena */
+static void
+fr_StoreLayout (struct fr_LayoutCache *cache, uint64_t hash, int fontIndex,
+                const wchar_t *string, size_t length,
+                const struct fr_Layout *layout)
+{
+  struct fr_LayoutEntry *entry;
+  size_t keySize, size;
+  int index;
+
+  keySize = fr_LayoutKeySize (length);
+  size = keySize + layout->glyphCount * sizeof (*layout->glyphs);
+
+  if (size > cache->arenaSize)
+    return;
+
+  if (cache->arenaUsed + size > cache->arenaSize)
+    {
+      while (cache->liveBytes + size > cache->arenaSize)
+        fr_EvictLayout (cache);
+
+      fr_CompactLayouts (cache);
+    }
+
+  if (cache->freeEntry == -1)
+    {
+      int i, oldAlloc = cache->entryAlloc;
+
+      cache->entryAlloc = oldAlloc ? oldAlloc * 2 : 256;
+
+      if (!(cache->entries = realloc (cache->entries, cache->entryAlloc * sizeof (*cache->entries))))
+        {
+          fprintf (stderr, "Failed to allocate layout cache entries\n");
+
+          exit (EXIT_FAILURE);
+        }
+
+      for (i = cache->entryAlloc - 1; i >= oldAlloc; --i)
+        {
+          cache->entries[i].next = cache->freeEntry;
+          cache->freeEntry = i;
+        }
+    }
+
+  index = cache->freeEntry;
+  entry = &cache->entries[index];
+  cache->freeEntry = entry->next;
+
+  entry->hash = hash;
+  entry->fontIndex = fontIndex;
+  entry->offset = cache->arenaUsed;
+  entry->size = size;
+  entry->length = length;
+  entry->width = layout->width;
+  entry->height = layout->height;
+  entry->glyphCount = layout->glyphCount;
+
+  memcpy (cache->arena + entry->offset, string, length * sizeof (*string));
+  memcpy (cache->arena + entry->offset + keySize, layout->glyphs,
+          layout->glyphCount * sizeof (*layout->glyphs));
+
+  cache->arenaUsed += size;
+  cache->liveBytes += size;
+
+  entry->next = cache->buckets[hash & cache->bucketMask];
+  cache->buckets[hash & cache->bucketMask] = index;
+
+  fr_LinkNewestLayout (cache, index);
+}
+
+/* Returns the glyphs of `string' and its bounding box.  The result is valid
+ * until the next call.  */
+static void
+fr_LayoutString (struct fr_Font *font, int fontIndex, const wchar_t *string,
+                 struct fr_LayoutCache *cache, struct fr_Layout *layout)
+{
+  struct fr_PlacedGlyph *placed;
+  size_t length, i;
+  uint64_t hash = 0;
+  int x, pen, index;
+  int left = 0, right = 0, top = 0, bottom = 0;
+
+  length = wcslen (string);
+
+  if (cache->arena)
+    {
+      hash = fr_HashString (fontIndex, string, length);
+
+      for (index = cache->buckets[hash & cache->bucketMask]; index != -1;
+           index = cache->entries[index].next)
+        {
+          const struct fr_LayoutEntry *entry = &cache->entries[index];
+
+          if (entry->hash != hash || entry->fontIndex != fontIndex
+              || entry->length != length
+              || wmemcmp ((const wchar_t *) (cache->arena + entry->offset), string, length))
+            continue;
+
+          layout->width = entry->width;
+          layout->height = entry->height;
+          layout->glyphCount = entry->glyphCount;
+          layout->glyphs = (const struct fr_PlacedGlyph *)
+            (cache->arena + entry->offset + fr_LayoutKeySize (length));
+
+          fr_UnlinkLayout (cache, index);
+          fr_LinkNewestLayout (cache, index);
+          ++cache->hits;
+
+          return;
+        }
+
+      ++cache->misses;
+    }
+
+  if (length > cache->placedAlloc)
+    {
+      cache->placedAlloc = length;
+
+      if (!(cache->placed = realloc (cache->placed, cache->placedAlloc * sizeof (*cache->placed))))
+        {
+          fprintf (stderr, "Failed to allocate glyph list\n");
+
+          exit (EXIT_FAILURE);
+        }
+    }
+
+  placed = cache->placed;
+  layout->glyphCount = 0;
+
+  for (pen = 0, i = 0; i < length; ++i)
+    {
+      struct fr_GlyphInfo *glyph;
+      struct fr_PlacedGlyph *p;
+
+      if (!(glyph = fr_NextGlyph (font, fontIndex, &pen, string[i], &x)))
+        continue;
+
+      p = &placed[layout->glyphCount++];
+      p->x = x - glyph->x;
+      p->y = -glyph->y;
+      p->u = glyph->u;
+      p->v = glyph->v;
+      p->width = glyph->width;
+      p->height = glyph->height;
+
+      if (p->x < left)
+        left = p->x;
+
+      if (p->x + glyph->width > right)
+        right = p->x + glyph->width;
+
+      if (p->y < top)
+        top = p->y;
+
+      if (p->y + glyph->height > bottom)
+        bottom = p->y + glyph->height;
+    }
+
+  for (i = 0; i < layout->glyphCount; ++i)
+    {
+      placed[i].x -= left;
+      placed[i].y -= top;
+    }
+
+  /* Image formats do not allow empty images */
+  layout->width = (right > left) ? right - left : 1;
+  layout->height = (bottom > top) ? bottom - top : 1;
+  layout->glyphs = placed;
+
+  if (cache->arena)
+    fr_StoreLayout (cache, hash, fontIndex, string, length, layout);
+}
+
+/* Output pixel formats of the framebuffer */
+enum fr_OutputFormat
+{
+  FR_OUTPUT_RGBA,
+  FR_OUTPUT_GRAY
+};
+
+/* Target for rendering strings.  The pixel buffer only grows, so it is
+ * reused across strings.  */
+struct fr_Framebuffer
+{
+  enum fr_OutputFormat format;
+  unsigned int width, height;
+
+  uint8_t *pixels;
+  size_t alloc;
+
+  uint8_t color[4];      /* text color; alpha is always 255 */
+  uint8_t background[4];
+};
+
+static unsigned int
+fr_BytesPerPixel (const struct fr_Framebuffer *fb)
+{
+  return (fb->format == FR_OUTPUT_GRAY) ? 1 : 4;
+}
+
+/* Exact x / 255 for x <= 255 * 255 */
+#define FR_DIV255(x) (((x) + 128 + (((x) + 128) >> 8)) >> 8)
+
+#ifdef __SSE2__
+/* Returns (target * (255 - coverage) + color * coverage) / 255 for eight
+ * 16-bit lanes */
+static inline __m128i
+fr_Blend16 (__m128i target, __m128i coverage, __m128i color)
+{
+  __m128i x;
+
+  x = _mm_add_epi16 (_mm_mullo_epi16 (target, _mm_sub_epi16 (_mm_set1_epi16 (255), coverage)),
+                     _mm_mullo_epi16 (color, coverage));
+  x = _mm_add_epi16 (x, _mm_set1_epi16 (128));
+
+  return _mm_srli_epi16 (_mm_add_epi16 (x, _mm_srli_epi16 (x, 8)), 8);
+}
+#endif
+
+/* Blends `color' over `count' RGBA pixels, using the LCD coverage of each
+ * subpixel as its own blend factor.  */
+static void
+fr_BlendRowRGBA (uint8_t *target, const uint8_t *coverage, unsigned int count,
+                 const uint8_t color[4])
+{
+  unsigned int i = 0;
+
+#ifdef __SSE2__
+  __m128i zero, colors;
+
+  zero = _mm_setzero_si128 ();
+  colors = _mm_set_epi16 (color[3], color[2], color[1], color[0],
+                          color[3], color[2], color[1], color[0]);
+
+  for (; i + 4 <= count; i += 4)
+    {
+      __m128i src, dst, lo, hi;
+
+      src = _mm_loadu_si128 ((const __m128i *) (coverage + i * 4));
+      dst = _mm_loadu_si128 ((const __m128i *) (target + i * 4));
+
+      lo = fr_Blend16 (_mm_unpacklo_epi8 (dst, zero), _mm_unpacklo_epi8 (src, zero), colors);
+      hi = fr_Blend16 (_mm_unpackhi_epi8 (dst, zero), _mm_unpackhi_epi8 (src, zero), colors);
+
+      _mm_storeu_si128 ((__m128i *) (target + i * 4), _mm_packus_epi16 (lo, hi));
+    }
+
+  /* Narrow glyphs are common, so the last one to three pixels are blended
+   * with partial loads rather than left to the scalar loop.  */
+  if (i + 2 <= count)
+    {
+      __m128i src, dst;
+
+      src = _mm_loadl_epi64 ((const __m128i *) (coverage + i * 4));
+      dst = _mm_loadl_epi64 ((const __m128i *) (target + i * 4));
+
+      dst = fr_Blend16 (_mm_unpacklo_epi8 (dst, zero), _mm_unpacklo_epi8 (src, zero), colors);
+
+      _mm_storel_epi64 ((__m128i *) (target + i * 4), _mm_packus_epi16 (dst, zero));
+
+      i += 2;
+    }
+
+  if (i < count)
+    {
+      __m128i src, dst;
+      uint32_t pixel;
+
+      memcpy (&pixel, coverage + i * 4, 4);
+      src = _mm_cvtsi32_si128 (pixel);
+      memcpy (&pixel, target + i * 4, 4);
+      dst = _mm_cvtsi32_si128 (pixel);
+
+      dst = fr_Blend16 (_mm_unpacklo_epi8 (dst, zero), _mm_unpacklo_epi8 (src, zero), colors);
+
+      pixel = _mm_cvtsi128_si32 (_mm_packus_epi16 (dst, zero));
+      memcpy (target + i * 4, &pixel, 4);
+
+      ++i;
+    }
+#endif
+
+  for (; i < count; ++i)
+    {
+      unsigned int c;
+
+      for (c = 0; c < 4; ++c)
+        {
+          unsigned int a = coverage[i * 4 + c];
+
+          target[i * 4 + c] = FR_DIV255 (target[i * 4 + c] * (255 - a) + color[c] * a);
+        }
+    }
+}
+
+/* Blends `luma' over `count' gray pixels, using the glyph's alpha */
+static void
+fr_BlendRowGray (uint8_t *target, const uint8_t *coverage, unsigned int count,
+                 uint8_t luma)
+{
+  unsigned int i = 0;
+
+#ifdef __SSE2__
+  __m128i zero, value;
+
+  zero = _mm_setzero_si128 ();
+  value = _mm_set1_epi16 (luma);
+
+  for (; i + 8 <= count; i += 8)
+    {
+      __m128i a, d;
+
+      /* Alpha is the top byte of each RGBA pixel */
+      a = _mm_packs_epi32 (_mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *) (coverage + i * 4)), 24),
+                           _mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *) (coverage + i * 4 + 16)), 24));
+      d = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((const __m128i *) (target + i)), zero);
+
+      _mm_storel_epi64 ((__m128i *) (target + i),
+                        _mm_packus_epi16 (fr_Blend16 (d, a, value), zero));
+    }
+#endif
+
+  for (; i < count; ++i)
+    {
+      unsigned int a = coverage[i * 4 + 3];
+
+      target[i] = FR_DIV255 (target[i] * (255 - a) + luma * a);
+    }
+}
+
+/* Resizes the framebuffer and fills it with the background color */
+static void
+fr_ClearFramebuffer (struct fr_Framebuffer *fb, unsigned int width,
+                     unsigned int height)
+{
+  size_t size, i;
+
+  fb->width = width;
+  fb->height = height;
+
+  size = (size_t) width * height * fr_BytesPerPixel (fb);
+
+  if (size > fb->alloc)
+    {
+      free (fb->pixels);
+
+      if (!(fb->pixels = malloc (size)))
+        {
+          fprintf (stderr, "Failed to allocate %ux%u framebuffer\n", width, height);
+
+          exit (EXIT_FAILURE);
+        }
+
+      fb->alloc = size;
+    }
+
+  if (fb->format == FR_OUTPUT_GRAY)
+    {
+      memset (fb->pixels, fb->background[0], size);
+
+      return;
+    }
+
+  for (i = 0; i < size; i += 4)
+    memcpy (fb->pixels + i, fb->background, 4);
+}
+
+/* Draws `string' into a framebuffer that just fits it, and returns the
+ * number of glyphs drawn.  */
+static unsigned int
+fr_DrawString (struct fr_Font *font, int fontIndex, const wchar_t *string,
+               struct fr_Framebuffer *fb, struct fr_LayoutCache *layouts)
+{
+  struct fr_Layout layout;
+  unsigned int bpp, i;
+
+  fr_LayoutString (font, fontIndex, string, layouts, &layout);
+
+  fr_ClearFramebuffer (fb, layout.width, layout.height);
+
+  bpp = fr_BytesPerPixel (fb);
+
+  for (i = 0; i < layout.glyphCount; ++i)
+    {
+      const struct fr_PlacedGlyph *glyph = &layout.glyphs[i];
+      const uint8_t *source;
+      uint8_t *target;
+      unsigned int row;
+
+      source = font->bitmap + ((size_t) glyph->v * font->atlasSize + glyph->u) * 4;
+      target = fb->pixels + ((size_t) glyph->y * fb->width + glyph->x) * bpp;
+
+      for (row = 0; row < glyph->height; ++row)
+        {
+          if (fb->format == FR_OUTPUT_GRAY)
+            fr_BlendRowGray (target, source, glyph->width, fb->color[0]);
+          else
+            fr_BlendRowRGBA (target, source, glyph->width, fb->color);
+
+          source += font->atlasSize * 4;
+          target += fb->width * bpp;
+        }
+    }
+
+  return layout.glyphCount;
+}
+
+/* Color modes of the terminal preview */
+enum fr_TerminalMode
+{
+  FR_TERMINAL_16,
+  FR_TERMINAL_256,
+  FR_TERMINAL_TRUECOLOR
+};
+
+/* Bits per channel kept when looking up colors in the quantization table */
+#define FR_LUT_BITS 5
+#define FR_LUT_INDEX(rgb) \
+  ((((rgb)[0] >> (8 - FR_LUT_BITS)) << (2 * FR_LUT_BITS)) \
+   | (((rgb)[1] >> (8 - FR_LUT_BITS)) << FR_LUT_BITS) \
+   | ((rgb)[2] >> (8 - FR_LUT_BITS)))
+
+/* Table entry of cells that need a full palette search */
+#define FR_LUT_AMBIGUOUS 0xff
+
+/* The 16 color palette.  `code' is the offset from SGR 30 (or 90 for bright
+ * colors) of each entry.  */
+static const struct
+{
+  uint8_t r, g, b;
+  uint8_t code, bright;
+}
+fr_palette[] =
+{
+    { 0x00, 0x00, 0x00, 0, 0 },
+    { 0x18, 0x18, 0xc2, 4, 0 },
+    { 0x18, 0xc2, 0x18, 2, 0 },
+    { 0x18, 0xc2, 0xc2, 6, 0 },
+    { 0xc2, 0x18, 0x18, 1, 0 },
+    { 0xc2, 0x18, 0xc2, 5, 0 },
+    { 0xc2, 0xc2, 0x18, 3, 0 },
+    { 0xc2, 0xc2, 0xc2, 7, 0 },
+    { 0x68, 0x68, 0x68, 0, 1 },
+    { 0x74, 0x74, 0xff, 4, 1 },
+    { 0x54, 0xff, 0x54, 2, 1 },
+    { 0x54, 0xff, 0xff, 6, 1 },
+    { 0xff, 0x54, 0x54, 1, 1 },
+    { 0xff, 0x54, 0xff, 5, 1 },
+    { 0xff, 0xff, 0x54, 3, 1 },
+    { 0xff, 0xff, 0xff, 7, 1 }
+};
+
+/* Characters of decreasing density, used when each pixel is one character */
+static const char fr_intensity[] = "%@&#$=+<;:-. ";
+
+struct fr_Terminal
+{
+  enum fr_TerminalMode mode;
+  int halfBlock; /* two pixel rows per line, drawn with U+2580 */
+
+  /* Maps quantized RGB to a color index */
+  uint8_t *lut;
+
+  /* Text of the frame being printed */
+  char *buffer;
+  size_t length, alloc;
+
+  /* Colors currently selected, or -1 if none */
+  long foreground, background;
+};
+
+/* Returns the darkest palette entry not darker than `rgb' in any channel */
+static uint8_t
+fr_MatchIntensity (unsigned int r, unsigned int g, unsigned int b)
+{
+  unsigned int nearest = 0, nearestScore = 768, i;
+
+  for (i = 0; i < sizeof (fr_palette) / sizeof (fr_palette[0]); ++i)
+    {
+      unsigned int score, dr, dg, db;
+
+      if (r > fr_palette[i].r || g > fr_palette[i].g || b > fr_palette[i].b)
+        continue;
+
+      dr = (fr_palette[i].r - r);
+      dg = (fr_palette[i].g - g);
+      db = (fr_palette[i].b - b);
+
+      score = (dr > dg && dr > db) ? dr
+            : (dg > db) ? dg
+            : db;
+
+      if (score < nearestScore)
+        {
+          nearest = i;
+          nearestScore = score;
+        }
+    }
+
+  return nearest;
+}
+
+static unsigned int
+fr_Distance (unsigned int r0, unsigned int g0, unsigned int b0,
+             unsigned int r1, unsigned int g1, unsigned int b1)
+{
+  int dr = r0 - r1, dg = g0 - g1, db = b0 - b1;
+
+  return dr * dr + dg * dg + db * db;
+}
+
+static uint8_t
+fr_MatchPalette (unsigned int r, unsigned int g, unsigned int b)
+{
+  unsigned int nearest = 0, nearestDistance = ~0u, i, distance;
+
+  for (i = 0; i < sizeof (fr_palette) / sizeof (fr_palette[0]); ++i)
+    {
+      distance = fr_Distance (r, g, b, fr_palette[i].r, fr_palette[i].g, fr_palette[i].b);
+
+      if (distance < nearestDistance)
+        {
+          nearest = i;
+          nearestDistance = distance;
+        }
+    }
+
+  return nearest;
+}
+
+/* Returns the nearest entry of the xterm 6x6x6 color cube or gray ramp */
+static uint8_t
+fr_Match256 (unsigned int r, unsigned int g, unsigned int b)
+{
+  static const uint8_t levels[6] = { 0x00, 0x5f, 0x87, 0xaf, 0xd7, 0xff };
+  unsigned int rgb[3], cube[3], c, i, gray;
+
+  rgb[0] = r;
+  rgb[1] = g;
+  rgb[2] = b;
+
+  for (c = 0; c < 3; ++c)
+    {
+      for (cube[c] = 0, i = 1; i < 6; ++i)
+        {
+          if (abs ((int) rgb[c] - levels[i]) < abs ((int) rgb[c] - levels[cube[c]]))
+            cube[c] = i;
+        }
+    }
+
+  /* The gray ramp runs from 8 to 238 in steps of 10 */
+  gray = (r + g + b) / 3;
+  gray = (gray < 8) ? 0 : (gray > 238) ? 23 : (gray - 3) / 10;
+
+  if (fr_Distance (r, g, b, 8 + gray * 10, 8 + gray * 10, 8 + gray * 10)
+      < fr_Distance (r, g, b, levels[cube[0]], levels[cube[1]], levels[cube[2]]))
+    return 232 + gray;
+
+  return 16 + cube[0] * 36 + cube[1] * 6 + cube[2];
+}
+
+static void
+fr_InitTerminal (struct fr_Terminal *term, enum fr_TerminalMode mode,
+                 int halfBlock)
+{
+  unsigned int r, g, b, step = 1 << (8 - FR_LUT_BITS);
+  uint8_t *entry;
+
+  memset (term, 0, sizeof (*term));
+  term->mode = mode;
+  term->halfBlock = halfBlock;
+  term->foreground = -1;
+  term->background = -1;
+
+  if (mode == FR_TERMINAL_TRUECOLOR)
+    return;
+
+  if (!(term->lut = malloc (sizeof (*term->lut) << (3 * FR_LUT_BITS))))
+    {
+      fprintf (stderr, "Failed to allocate color table\n");
+
+      exit (EXIT_FAILURE);
+    }
+
+  /* Nearest colors are matched at the center of each cell.  Intensity
+   * characters are meant to be exact, so cells whose corners disagree are
+   * marked for a full search instead.  */
+  entry = term->lut;
+
+  for (r = 0; r < 256; r += step)
+    {
+      for (g = 0; g < 256; g += step)
+        {
+          for (b = 0; b < 256; b += step, ++entry)
+            {
+              unsigned int corner;
+
+              if (mode == FR_TERMINAL_256)
+                {
+                  *entry = fr_Match256 (r + step / 2, g + step / 2, b + step / 2);
+
+                  continue;
+                }
+
+              if (halfBlock)
+                {
+                  *entry = fr_MatchPalette (r + step / 2, g + step / 2, b + step / 2);
+
+                  continue;
+                }
+
+              *entry = fr_MatchIntensity (r, g, b);
+
+              for (corner = 1; corner < 8 && *entry != FR_LUT_AMBIGUOUS; ++corner)
+                {
+                  if (*entry != fr_MatchIntensity (r + ((corner & 4) ? step - 1 : 0),
+                                                   g + ((corner & 2) ? step - 1 : 0),
+                                                   b + ((corner & 1) ? step - 1 : 0)))
+                    *entry = FR_LUT_AMBIGUOUS;
+                }
+            }
+        }
+    }
+}
+
+static inline void
+fr_TerminalAppend (struct fr_Terminal *term, const char *data, size_t size)
+{
+  if (term->length + size > term->alloc)
+    {
+      term->alloc = term->alloc ? term->alloc * 2 : 65536;
+
+      while (term->length + size > term->alloc)
+        term->alloc *= 2;
+
+      if (!(term->buffer = realloc (term->buffer, term->alloc)))
+        {
+          fprintf (stderr, "Failed to allocate %zu bytes of terminal output\n",
+                   term->alloc);
+
+          exit (EXIT_FAILURE);
+        }
+    }
+
+  memcpy (term->buffer + term->length, data, size);
+  term->length += size;
+}
+
+/* Returns the color index of `rgb', or the color itself in truecolor mode */
+static long
+fr_TerminalColor (const struct fr_Terminal *term, const uint8_t *rgb)
+{
+  if (term->mode == FR_TERMINAL_TRUECOLOR)
+    return (long) rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+
+  return term->lut[FR_LUT_INDEX (rgb)];
+}
+
+static char *
+fr_FormatDecimal (char *output, unsigned int value)
+{
+  if (value >= 100)
+    *output++ = '0' + value / 100;
+
+  if (value >= 10)
+    *output++ = '0' + value / 10 % 10;
+
+  *output++ = '0' + value % 10;
+
+  return output;
+}
+
+/* Writes the escape sequence selecting `color', and returns its length.
+ * This runs for most pixels on antialiased edges, so it avoids printf.  */
+static size_t
+fr_FormatColor (const struct fr_Terminal *term, int background, long color,
+                char *output)
+{
+  char *end = output;
+
+  *end++ = '\033';
+  *end++ = '[';
+
+  switch (term->mode)
+    {
+    case FR_TERMINAL_TRUECOLOR:
+
+      end = fr_FormatDecimal (end, background ? 48 : 38);
+      memcpy (end, ";2;", 3);
+      end = fr_FormatDecimal (end + 3, color >> 16);
+      *end++ = ';';
+      end = fr_FormatDecimal (end, (color >> 8) & 0xff);
+      *end++ = ';';
+      end = fr_FormatDecimal (end, color & 0xff);
+
+      break;
+
+    case FR_TERMINAL_256:
+
+      end = fr_FormatDecimal (end, background ? 48 : 38);
+      memcpy (end, ";5;", 3);
+      end = fr_FormatDecimal (end + 3, color);
+
+      break;
+
+    case FR_TERMINAL_16:
+
+      if (term->halfBlock)
+        {
+          end = fr_FormatDecimal (end, (background ? 40 : 30) + fr_palette[color].code
+                                       + (fr_palette[color].bright ? 60 : 0));
+        }
+      else
+        {
+          end = fr_FormatDecimal (end, fr_palette[color].bright ? 3 : 23);
+          *end++ = ';';
+          end = fr_FormatDecimal (end, 30 + fr_palette[color].code);
+        }
+
+      break;
+    }
+
+  *end++ = 'm';
+
+  return end - output;
+}
+
+/* Selects a foreground or background color, unless it is already selected */
+static void
+fr_TerminalSetColor (struct fr_Terminal *term, int background, long color)
+{
+  char sequence[32];
+
+  if (color == (background ? term->background : term->foreground))
+    return;
+
+  fr_TerminalAppend (term, sequence, fr_FormatColor (term, background, color, sequence));
+
+  if (background)
+    term->background = color;
+  else
+    term->foreground = color;
+}
+
+static void
+fr_TerminalReset (struct fr_Terminal *term)
+{
+  if (term->foreground == -1 && term->background == -1)
+    return;
+
+  fr_TerminalAppend (term, "\033[0m", 4);
+  term->foreground = -1;
+  term->background = -1;
+}
+
+/* Adds an RGBA image to the frame.  Alpha is ignored.  */
+static void
+fr_TerminalImage (struct fr_Terminal *term, const uint8_t *pixels,
+                  unsigned int width, unsigned int height, size_t stride)
+{
+  static const uint8_t black[4] = { 0, 0, 0, 255 };
+  unsigned int x, y, lastIndex = 0;
+  uint32_t lastColor = ~0u;
+
+  for (y = 0; y < height; y += term->halfBlock ? 2 : 1)
+    {
+      const uint8_t *row = pixels + y * stride;
+      const uint8_t *next = (y + 1 < height) ? row + stride : NULL;
+
+      for (x = 0; x < width; ++x)
+        {
+          const uint8_t *pixel = row + x * 4;
+
+          if (term->halfBlock)
+            {
+              long top, bottom;
+
+              top = fr_TerminalColor (term, pixel);
+              bottom = fr_TerminalColor (term, next ? next + x * 4 : black);
+
+              fr_TerminalSetColor (term, 1, bottom);
+
+              if (top == bottom)
+                fr_TerminalAppend (term, " ", 1);
+              else
+                {
+                  fr_TerminalSetColor (term, 0, top);
+                  fr_TerminalAppend (term, "\xe2\x96\x80", 3);
+                }
+            }
+          else if (term->mode != FR_TERMINAL_16)
+            {
+              fr_TerminalSetColor (term, 1, fr_TerminalColor (term, pixel));
+              fr_TerminalAppend (term, " ", 1);
+            }
+          else
+            {
+              unsigned int index, score;
+
+              index = term->lut[FR_LUT_INDEX (pixel)];
+
+              /* Runs of one color, such as the background, are common */
+              if (index == FR_LUT_AMBIGUOUS)
+                {
+                  uint32_t color = pixel[0] << 16 | pixel[1] << 8 | pixel[2];
+
+                  if (color != lastColor)
+                    {
+                      lastColor = color;
+                      lastIndex = fr_MatchIntensity (pixel[0], pixel[1], pixel[2]);
+                    }
+
+                  index = lastIndex;
+                }
+
+              score = fr_palette[index].r - pixel[0];
+
+              if (fr_palette[index].g - pixel[1] > score)
+                score = fr_palette[index].g - pixel[1];
+
+              if (fr_palette[index].b - pixel[2] > score)
+                score = fr_palette[index].b - pixel[2];
+
+              fr_TerminalSetColor (term, 0, index);
+              fr_TerminalAppend (term, &fr_intensity[score * (sizeof (fr_intensity) - 1) / 256], 1);
+            }
+        }
+
+      /* Background colors would otherwise fill the rest of the line */
+      if (term->background != -1)
+        fr_TerminalReset (term);
+
+      fr_TerminalAppend (term, "\n", 1);
+    }
+}
+
+/* Writes the frame with a single call */
+static void
+fr_TerminalFlush (struct fr_Terminal *term)
+{
+  fr_TerminalReset (term);
+
+  if (term->length && fwrite (term->buffer, 1, term->length, stdout) != term->length)
+    {
+      fprintf (stderr, "Failed to write preview\n");
+
+      exit (EXIT_FAILURE);
+    }
+
+  fflush (stdout);
+  term->length = 0;
+}
+
+static void
+fr_RenderString (struct fr_Font *font, int fontIndex, const wchar_t *string,
+                 struct fr_Terminal *term)
+{
+  static struct fr_Framebuffer fb =
+    {
+      FR_OUTPUT_RGBA, 0, 0, NULL, 0, { 255, 255, 255, 255 }, { 0, 0, 0, 255 }
+    };
+  struct fr_LayoutCache layouts;
+
+  /* A single string gains nothing from caching its layout */
+  fr_InitLayoutCache (&layouts, 0);
+
+  fr_DrawString (font, fontIndex, string, &fb, &layouts);
+  fr_TerminalImage (term, fb.pixels, fb.width, fb.height, (size_t) fb.width * 4);
+  fr_TerminalFlush (term);
+}
+
+static void
+fr_WritePNG (const char *path, const struct fr_Framebuffer *fb)
+{
+  FILE *output;
+  png_structp png;
+  png_infop info;
+  unsigned int y;
+
+  if (!(output = fopen (path, "wb")))
+    {
+      fprintf (stderr, "Failed to open `%s' for writing\n", path);
+
+      exit (EXIT_FAILURE);
+    }
+
+  if (!(png = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL))
+      || !(info = png_create_info_struct (png)))
+    {
+      fprintf (stderr, "Failed to create PNG writer\n");
+
+      exit (EXIT_FAILURE);
+    }
+
+  if (setjmp (png_jmpbuf (png)))
+    {
+      fprintf (stderr, "Failed to write `%s'\n", path);
+
+      exit (EXIT_FAILURE);
+    }
+
+  png_init_io (png, output);
+  png_set_IHDR (png, info, fb->width, fb->height, 8,
+                (fb->format == FR_OUTPUT_GRAY) ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB_ALPHA,
+                PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                PNG_FILTER_TYPE_DEFAULT);
+
+  /* Thumbnails are small; favor speed over size */
+  png_set_compression_level (png, 1);
+
+  png_write_info (png, info);
+
+  for (y = 0; y < fb->height; ++y)
+    png_write_row (png, fb->pixels + (size_t) y * fb->width * fr_BytesPerPixel (fb));
+
+  png_write_end (png, NULL);
+  png_destroy_write_struct (&png, &info);
+
+  if (fclose (output))
+    {
+      fprintf (stderr, "Failed to write `%s'\n", path);
+
+      exit (EXIT_FAILURE);
+    }
+}
+
+/* Converts `string' to a wide string in `*result', growing it as needed.
+ * Bytes that are not valid in the current locale are taken as
+ * ISO-8859-1.  */
+static void
+fr_WideString (const char *string, wchar_t **result, size_t *alloc)
+{
+  size_t length, i;
+
+  length = strlen (string);
+
+  if (length + 1 > *alloc)
+    {
+      *alloc = length + 1;
+
+      if (!(*result = realloc (*result, *alloc * sizeof (**result))))
+        {
+          fprintf (stderr, "Failed to allocate string\n");
+
+          exit (EXIT_FAILURE);
+        }
+    }
+
+  if ((size_t) -1 == mbstowcs (*result, string, length + 1))
+    {
+      for (i = 0; i <= length; ++i)
+        (*result)[i] = (unsigned char) string[i];
+    }
+}
+
+/* Reads a line without its line break into `*line', growing it as needed.
+ * Returns -1 at end of input.  */
+static int
+fr_ReadLine (FILE *input, char **line, size_t *alloc)
+{
+  size_t length = 0;
+
+  for (;;)
+    {
+      if (*alloc - length < 2)
+        {
+          *alloc = *alloc ? *alloc * 2 : 256;
+
+          if (!(*line = realloc (*line, *alloc)))
+            {
+              fprintf (stderr, "Failed to allocate line buffer\n");
+
+              exit (EXIT_FAILURE);
+            }
+        }
+
+      if (!fgets (*line + length, *alloc - length, input))
+        return length ? 0 : -1;
+
+      length += strlen (*line + length);
+
+      if (length && (*line)[length - 1] == '\n')
+        {
+          (*line)[length - 1] = 0;
+
+          return 0;
+        }
+    }
+}
+
+/* Renders every line of `input' to DIRECTORY/NNNNNN.png, numbered from 0 */
+static void
+fr_RenderBatch (struct fr_Font *font, int fontIndex, FILE *input,
+                const char *directory, struct fr_Framebuffer *fb,
+                size_t layoutCacheSize, int printStatistics)
+{
+  struct fr_LayoutCache layouts;
+  char *line = NULL;
+  wchar_t *string = NULL;
+  size_t lineAlloc = 0, stringAlloc = 0;
+  unsigned long index = 0, glyphCount = 0;
+  clock_t drawTime = 0, writeTime = 0, start;
+  char *path;
+
+  if (!(path = malloc (strlen (directory) + 32)))
+    {
+      fprintf (stderr, "Failed to allocate path buffer\n");
+
+      exit (EXIT_FAILURE);
+    }
+
+  fr_InitLayoutCache (&layouts, layoutCacheSize);
+
+  while (-1 != fr_ReadLine (input, &line, &lineAlloc))
+    {
+      fr_WideString (line, &string, &stringAlloc);
+
+      start = clock ();
+      glyphCount += fr_DrawString (font, fontIndex, string, fb, &layouts);
+      drawTime += clock () - start;
+
+      sprintf (path, "%s/%06lu.png", directory, index++);
+
+      start = clock ();
+      fr_WritePNG (path, fb);
+      writeTime += clock () - start;
+    }
+
+  if (printStatistics)
+    {
+      double drawSeconds = (double) drawTime / CLOCKS_PER_SEC;
+      double writeSeconds = (double) writeTime / CLOCKS_PER_SEC;
+
+      fprintf (stderr, "Strings:   %lu (%lu glyphs)\n", index, glyphCount);
+      fprintf (stderr, "Drawing:   %.3f s (%.0f glyphs/s)\n", drawSeconds,
+               drawSeconds > 0 ? glyphCount / drawSeconds : 0.0);
+      fprintf (stderr, "PNG:       %.3f s (%.0f images/s)\n", writeSeconds,
+               writeSeconds > 0 ? index / writeSeconds : 0.0);
+      fprintf (stderr, "Layouts:   %lu cached, %lu laid out, %lu evicted\n",
+               layouts.hits, layouts.misses, layouts.evictions);
+    }
+
+  free (layouts.arena);
+  free (layouts.buckets);
+  free (layouts.entries);
+  free (layouts.placed);
+  free (line);
+  free (string);
+  free (path);
+}
+
+struct fr_TextureCache
+{
+  uint32_t tags[FR_CACHE_MAX_LINES];
+  unsigned long lastUse[FR_CACHE_MAX_LINES];
+  unsigned int lineCount;
+  unsigned long clock;
+
+  unsigned long fetches, misses;
+};
+
+static void
+fr_FetchTile (struct fr_TextureCache *cache, uint32_t tag)
+{
+  unsigned int i, oldest = 0;
+
+  ++cache->fetches;
+  ++cache->clock;
+
+  for (i = 0; i < cache->lineCount; ++i)
+    {
+      if (cache->lastUse[i] && cache->tags[i] == tag)
+        {
+          cache->lastUse[i] = cache->clock;
+
+          return;
+        }
+
+      if (cache->lastUse[i] < cache->lastUse[oldest])
+        oldest = i;
+    }
+
+  ++cache->misses;
+
+  cache->tags[oldest] = tag;
+  cache->lastUse[oldest] = cache->clock;
+}
+
+/* Draws every line of `input' in order and counts how well the atlas
+ * texels it samples fit in a small texture cache.  */
+static void
+fr_BenchmarkLocality (struct fr_Font *font, int fontIndex, FILE *input,
+                      unsigned int cacheLines)
+{
+  struct fr_TextureCache cache;
+  uint8_t *touched;
+  unsigned int tilesPerRow, touchedCount = 0;
+  unsigned long glyphCount = 0, texels = 0;
+  int pen, x;
+  char *line = NULL;
+  wchar_t *string = NULL;
+  size_t lineAlloc = 0, stringAlloc = 0;
+
+  memset (&cache, 0, sizeof (cache));
+  cache.lineCount = cacheLines;
+
+  tilesPerRow = (font->atlasSize + FR_CACHE_TILE - 1) / FR_CACHE_TILE;
+  touched = calloc (tilesPerRow, tilesPerRow);
+
+  while (-1 != fr_ReadLine (input, &line, &lineAlloc))
+    {
+      const wchar_t *ch;
+
+      fr_WideString (line, &string, &stringAlloc);
+
+      for (pen = 0, ch = string; *ch; ++ch)
+        {
+          struct fr_GlyphInfo *glyph;
+          unsigned int tu, tv;
+
+          if (!(glyph = fr_NextGlyph (font, fontIndex, &pen, *ch, &x)))
+            continue;
+
+          ++glyphCount;
+          texels += glyph->width * glyph->height;
+
+          /* Rasterization visits the glyph quad in rows, so tiles are
+           * fetched row by row.  */
+          for (tv = glyph->v / FR_CACHE_TILE; tv <= (glyph->v + glyph->height - 1) / FR_CACHE_TILE; ++tv)
+            {
+              for (tu = glyph->u / FR_CACHE_TILE; tu <= (glyph->u + glyph->width - 1) / FR_CACHE_TILE; ++tu)
+                {
+                  fr_FetchTile (&cache, tv * tilesPerRow + tu);
+
+                  if (!touched[tv * tilesPerRow + tu])
+                    {
+                      touched[tv * tilesPerRow + tu] = 1;
+                      ++touchedCount;
+                    }
+                }
+            }
+        }
+    }
+
+  if (ferror (input))
+    {
+      fprintf (stderr, "Error reading benchmark text\n");
+
+      exit (EXIT_FAILURE);
+    }
+
+  printf ("Glyphs drawn:    %lu (%lu texels)\n", glyphCount, texels);
+  printf ("Tiles touched:   %u of %u (%ux%u texels, %u line cache)\n",
+          touchedCount, tilesPerRow * tilesPerRow,
+          FR_CACHE_TILE, FR_CACHE_TILE, cacheLines);
+  printf ("Tile fetches:    %lu, %lu misses (%.2f%% hit ratio)\n",
+          cache.fetches, cache.misses,
+          cache.fetches ? 100.0 * (cache.fetches - cache.misses) / cache.fetches : 0.0);
+
+  free (touched);
+  free (line);
+  free (string);
+}
+
+/* Parses a RRGGBB color */
+static void
+fr_ParseColor (const char *string, uint8_t rgba[4])
+{
+  unsigned long value;
+  char *endptr;
+
+  value = strtoul (string, &endptr, 16);
+
+  if (strlen (string) != 6 || *endptr)
+    {
+      fprintf (stderr, "Invalid color \"%s\".  Expected RRGGBB\n", string);
+
+      exit (EXIT_FAILURE);
+    }
+
+  rgba[0] = value >> 16;
+  rgba[1] = value >> 8;
+  rgba[2] = value;
+  rgba[3] = 255;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct fr_Font font;
+  struct fr_Framebuffer fb;
+  struct fr_Terminal term;
+  enum fr_TerminalMode terminalMode = FR_TERMINAL_16;
+  int i, fontIndex = 0, cacheLines = 64, printStatistics = 0;
+  int halfBlock = 0, previewAtlas = 0;
+  const char *benchmarkPath = NULL, *batchPath = NULL, *outputDirectory = NULL;
+  wchar_t *string = NULL;
+  size_t stringAlloc = 0, layoutCacheSize = FR_LAYOUT_CACHE_BYTES;
+  char *endptr;
+
+  memset (&fb, 0, sizeof (fb));
+  fb.format = FR_OUTPUT_RGBA;
+  fr_ParseColor ("ffffff", fb.color);
+  fr_ParseColor ("000000", fb.background);
+
+  setlocale (LC_CTYPE, "");
+
+  while ((i = getopt (argc, argv, "f:b:c:i:o:gC:B:sL:m:Ha")) != -1)
+    {
+      switch (i)
+        {
+        case 'f':
+
+          fontIndex = atoi (optarg);
+
+          break;
+
+        case 'b':
+
+          benchmarkPath = optarg;
+
+          break;
+
+        case 'c':
+
+          cacheLines = atoi (optarg);
+
+          if (cacheLines <= 0 || cacheLines > FR_CACHE_MAX_LINES)
+            {
+              fprintf (stderr, "Cache line count must be between 1 and %d\n",
+                       FR_CACHE_MAX_LINES);
+
+              return EXIT_FAILURE;
+            }
+
+          break;
+
+        case 'i':
+
+          batchPath = optarg;
+
+          break;
+
+        case 'o':
+
+          outputDirectory = optarg;
+
+          break;
+
+        case 'g':
+
+          fb.format = FR_OUTPUT_GRAY;
+
+          break;
+
+        case 'C':
+
+          fr_ParseColor (optarg, fb.color);
+
+          break;
+
+        case 'B':
+
+          fr_ParseColor (optarg, fb.background);
+
+          break;
+
+        case 's':
+
+          printStatistics = 1;
+
+          break;
+
+        case 'L':
+
+          layoutCacheSize = strtoul (optarg, &endptr, 0);
+
+          if (*endptr)
+            {
+              fprintf (stderr, "Invalid layout cache size `%s'\n", optarg);
+
+              return EXIT_FAILURE;
+            }
+
+          break;
+
+        case 'm':
+
+          if (!strcmp (optarg, "16"))
+            terminalMode = FR_TERMINAL_16;
+          else if (!strcmp (optarg, "256"))
+            terminalMode = FR_TERMINAL_256;
+          else if (!strcmp (optarg, "truecolor"))
+            terminalMode = FR_TERMINAL_TRUECOLOR;
+          else
+            {
+              fprintf (stderr, "Unknown color mode `%s'; expected 16, 256 or truecolor\n",
+                       optarg);
+
+              return EXIT_FAILURE;
+            }
+
+          break;
+
+        case 'H':
+
+          halfBlock = 1;
+
+          break;
+
+        case 'a':
+
+          previewAtlas = 1;
+
+          break;
+
+        default:
+
+          optind = argc;
+        }
+    }
+
+  if (optind + !(benchmarkPath || batchPath || previewAtlas) != argc
+      || (batchPath && !outputDirectory))
+    {
+      fprintf (stderr, "Usage: %s [-f FONT-INDEX] [-m 16|256|truecolor] [-H] <STRING>\n"
+                       "       %s [-m 16|256|truecolor] [-H] -a\n"
+                       "       %s [-f FONT-INDEX] [-c CACHE-LINES] -b <TEXT-FILE>\n"
+                       "       %s [-f FONT-INDEX] [-g] [-C RRGGBB] [-B RRGGBB] [-s] [-L BYTES] -i <TEXT-FILE> -o <DIRECTORY>\n",
+               argv[0], argv[0], argv[0], argv[0]);
+
+      return EXIT_FAILURE;
+    }
+
+  /* A string needs only its own glyphs, so it can be drawn before a
+   * streamed atlas is complete.  */
+  if (benchmarkPath || batchPath || previewAtlas)
+    fr_LoadFont (&font, stdin, fontIndex, NULL);
+  else
+    {
+      fr_WideString (argv[optind], &string, &stringAlloc);
+      fr_LoadFont (&font, stdin, fontIndex, string);
+    }
+
+  if (fontIndex < 0 || fontIndex >= font.fontCount)
+    {
+      fprintf (stderr, "Font index %d out of range; atlas has %zu fonts\n",
+               fontIndex, font.fontCount);
+
+      return EXIT_FAILURE;
+    }
+
+  if (benchmarkPath || batchPath)
+    {
+      const char *path = benchmarkPath ? benchmarkPath : batchPath;
+      FILE *input;
+
+      if (!(input = fopen (path, "r")))
+        {
+          fprintf (stderr, "Failed to open `%s' for reading\n", path);
+
+          return EXIT_FAILURE;
+        }
+
+      if (benchmarkPath)
+        fr_BenchmarkLocality (&font, fontIndex, input, cacheLines);
+      else
+        {
+          /* Gray output blends the luma of the text and background colors */
+          if (fb.format == FR_OUTPUT_GRAY)
+            {
+              fb.color[0] = (fb.color[0] * 54 + fb.color[1] * 183 + fb.color[2] * 19) >> 8;
+              fb.background[0] = (fb.background[0] * 54 + fb.background[1] * 183 + fb.background[2] * 19) >> 8;
+            }
+
+          fr_RenderBatch (&font, fontIndex, input, outputDirectory, &fb,
+                          layoutCacheSize, printStatistics);
+        }
+
+      fclose (input);
+
+      return EXIT_SUCCESS;
+    }
+
+  fr_InitTerminal (&term, terminalMode, halfBlock);
+
+  if (previewAtlas)
+    {
+      fr_TerminalImage (&term, font.bitmap, font.atlasSize, font.atlasSize,
+                        (size_t) font.atlasSize * 4);
+      fr_TerminalFlush (&term);
+
+      return EXIT_SUCCESS;
+    }
 
-  fr_RenderString (&font, argv[1]);
+  fr_RenderString (&font, fontIndex, string, &term);
 
   return EXIT_SUCCESS;
 }
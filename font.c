@@ -15,58 +15,874 @@
   You should have received a copy of the GNU General Public License
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
   */
+#define _POSIX_C_SOURCE 200809L
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
 
-#include <assert.h>
-#include <stdint.h>
-#include <string.h>
-#include <stdlib.h>
-#include <err.h>
-#include <sysexits.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <err.h>
+#include <sysexits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fontconfig/fontconfig.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_CACHE_H
+#include FT_MODULE_H
+#include FT_OUTLINE_H
+
+#include "font.h"
+
+/* Load flags used for every cached glyph bitmap */
+#define FONT_LOAD_FLAGS (FT_LOAD_RENDER | FT_LOAD_TARGET_LCD)
+
+/* Largest pixel size for which LCD bitmaps (three bytes per pixel) are
+ * expected to fit the 8-bit metrics of the small bitmap cache.  Larger sizes
+ * go straight to the image cache, as a glyph that does not fit is rendered
+ * again on every small bitmap cache lookup.  */
+#define FONT_SBIT_MAX_SIZE 42
+
+#define FONT_CACHE_MAGIC "BMFC"
+#define FONT_CACHE_VERSION 2
+
+/* Longest string accepted from the resolution cache file */
+#define FONT_CACHE_MAX_STRING 4096
+
+/* Code points covered by a face */
+struct font_Range
+{
+  uint32_t first, last;
+};
+
+struct font_CachedFace
+{
+  char *path;
+  int64_t stamp[3]; /* modification time and size of the file */
+
+  /* NULL if the coverage is unknown */
+  struct font_Range *ranges;
+  uint32_t rangeCount;
+};
+
+/* The fallback chain fontconfig chose for a font */
+struct font_CacheEntry
+{
+  char *name;
+  uint32_t size, weight;
+  uint64_t cost; /* nanoseconds fontconfig took */
+
+  struct font_CachedFace *faces;
+  uint32_t faceCount;
+};
+
+/* Passed to FreeType as an FTC_FaceID; one per path in the fallback chain */
+struct font_FaceID
+{
+  char *path;
+  int used; /* has provided glyphs or metrics */
+
+  struct font_Range *ranges;
+  uint32_t rangeCount;
+};
+
+/* FreeType's allocator, counting allocations to tell cache hits from
+ * misses */
+struct font_Memory
+{
+  struct FT_MemoryRec_ memory;
+
+  unsigned long allocations;
+};
+
+/* A glyph cache, with the faces and sizes it has opened */
+struct FONT_Context
+{
+  FT_Library library;
+  struct font_Memory *memory;
+  int ownsLibrary;
+
+  FTC_Manager cacheManager;
+  FTC_SBitCache sbitCache;
+  FTC_ImageCache imageCache;
+
+  unsigned long cacheHits, cacheMisses;
+  unsigned long uncachedRenders; /* glyphs rendered at a subpixel position */
+};
+
+/* Nothing here changes after FONT_Load, except through `context' */
+struct FONT_Data
+{
+  /* Used by the functions that take no context */
+  struct FONT_Context *context;
+
+  struct font_FaceID *faceIDs;
+  size_t faceCount;
+
+  unsigned int size;
+  unsigned int ascent, descent, lineHeight, spaceWidth;
+  int spaceAdvance; /* unhinted, 26.6 fixed point */
+};
+
+/* Shared by the contexts of loaded fonts */
+static FT_Library ft_library;
+
+static unsigned int font_cacheMaxFaces = 4;
+static unsigned int font_cacheMaxSizes = 4;
+static unsigned long font_cacheMaxBytes = 1024 * 1024;
+
+/* Font resolution cache.  Entries are kept in memory, and in the file at
+ * font_cachePath if it is not NULL.  */
+static char *font_cachePath;
+static int font_cachePathSet, font_cacheLoaded;
+
+static struct font_CacheEntry **font_cacheEntries;
+static size_t font_cacheEntryCount, font_cacheEntryAlloc;
+
+/* Files and directories whose changes invalidate the cache */
+static char **font_cacheStamps;
+static size_t font_cacheStampCount;
+static uint64_t font_cacheHash;
+
+static unsigned long font_cacheHits, font_cacheMisses;
+static double font_cacheSaved;
+
+static struct FONT_Glyph *
+font_GlyphForIndex (struct FONT_Context *context, struct FONT_Data *font,
+                    FTC_FaceID faceID, FT_UInt glyphIndex);
+
+static struct FONT_Glyph *
+font_GlyphAt (struct FONT_Context *context, struct FONT_Data *font,
+              wint_t character, int xShift);
+
+static struct FONT_Glyph *
+font_GlyphFromLCDBitmap (const FT_Byte *buffer, int pitch,
+                         unsigned int width, unsigned int rows);
+
+static FT_Error
+font_FaceRequester (FTC_FaceID faceID, FT_Library library,
+                    FT_Pointer requestData, FT_Face *face)
+{
+  struct font_FaceID *id = faceID;
+  FT_Error ret;
+
+  if (0 != (ret = FT_New_Face (library, id->path, 0, face)))
+    fprintf (stderr, "FT_New_Face on %s failed with code %d\n", id->path, ret);
+
+  return ret;
+}
+
+static void *
+font_Alloc (FT_Memory memory, long size)
+{
+  ++((struct font_Memory *) memory->user)->allocations;
+
+#if FREETYPE_MAJOR == 2 && FREETYPE_MINOR == 12
+  /* FreeType 2.12 allocates the cache manager without clearing its byte
+   * counter, which makes every lookup flush the cache.  */
+  return calloc (1, size);
+#else
+  return malloc (size);
+#endif
+}
+
+static void
+font_Free (FT_Memory memory, void *block)
+{
+  free (block);
+}
+
+static void *
+font_Realloc (FT_Memory memory, long currentSize, long newSize, void *block)
+{
+  return realloc (block, newSize);
+}
+
+/* Used by ft_library */
+static struct font_Memory font_memory;
+
+static void
+font_InitMemory (struct font_Memory *memory)
+{
+  memory->memory.user = memory;
+  memory->memory.alloc = font_Alloc;
+  memory->memory.free = font_Free;
+  memory->memory.realloc = font_Realloc;
+}
+
+static FT_Error
+font_NewLibrary (struct font_Memory *memory, FT_Library *library)
+{
+  FT_Error status;
+
+  font_InitMemory (memory);
+
+  if (0 != (status = FT_New_Library (&memory->memory, library)))
+    return status;
+
+  FT_Add_Default_Modules (*library);
+  FT_Set_Default_Properties (*library);
+
+  return 0;
+}
+
+void
+FONT_Init (void)
+{
+  int status;
+
+  if (0 != (status = font_NewLibrary (&font_memory, &ft_library)))
+    errx (EXIT_FAILURE, "Failed to initialize FreeType with status %d", status);
+}
+
+static struct FONT_Context *
+font_NewContext (FT_Library library, struct font_Memory *memory)
+{
+  struct FONT_Context *result;
+
+  if (!(result = calloc (1, sizeof (*result))))
+    return NULL;
+
+  result->library = library;
+  result->memory = memory;
+
+  if (0 != FTC_Manager_New (library, font_cacheMaxFaces, font_cacheMaxSizes,
+                            font_cacheMaxBytes, font_FaceRequester, NULL,
+                            &result->cacheManager)
+      || 0 != FTC_SBitCache_New (result->cacheManager, &result->sbitCache)
+      || 0 != FTC_ImageCache_New (result->cacheManager, &result->imageCache))
+    {
+      if (result->cacheManager)
+        FTC_Manager_Done (result->cacheManager);
+
+      free (result);
+
+      return NULL;
+    }
+
+  return result;
+}
+
+struct FONT_Context *
+FONT_NewContext (void)
+{
+  struct FONT_Context *result;
+  struct font_Memory *memory;
+  FT_Library library;
+
+  /* FreeType keeps using the allocator until the library is done */
+  if (!(memory = calloc (1, sizeof (*memory))))
+    return NULL;
+
+  if (0 != font_NewLibrary (memory, &library))
+    {
+      free (memory);
+
+      return NULL;
+    }
+
+  if (!(result = font_NewContext (library, memory)))
+    {
+      FT_Done_Library (library);
+      free (memory);
+
+      return NULL;
+    }
+
+  result->ownsLibrary = 1;
+
+  return result;
+}
+
+void
+FONT_FreeContext (struct FONT_Context *context)
+{
+  FTC_Manager_Done (context->cacheManager);
+
+  if (context->ownsLibrary)
+    {
+      FT_Done_Library (context->library);
+      free (context->memory);
+    }
+
+  free (context);
+}
+
+void
+FONT_ContextStatistics (struct FONT_Context *context,
+                        unsigned long *hits, unsigned long *misses,
+                        unsigned long *uncached)
+{
+  *hits = context->cacheHits;
+  *misses = context->cacheMisses;
+  *uncached = context->uncachedRenders;
+}
+
+void
+FONT_SetCacheLimits (unsigned int maxFaces, unsigned int maxSizes,
+                     unsigned long maxBytes)
+{
+  font_cacheMaxFaces = maxFaces;
+  font_cacheMaxSizes = maxSizes;
+  font_cacheMaxBytes = maxBytes;
+}
+
+void
+FONT_SetResolutionCache (const char *path)
+{
+  free (font_cachePath);
+
+  font_cachePath = path ? strdup (path) : NULL;
+  font_cachePathSet = 1;
+}
+
+void
+FONT_ResolutionStatistics (unsigned long *hits, unsigned long *misses,
+                           double *secondsSaved)
+{
+  *hits = font_cacheHits;
+  *misses = font_cacheMisses;
+  *secondsSaved = font_cacheSaved;
+}
+
+static uint64_t
+font_Now (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* 64-bit FNV-1a */
+static uint64_t
+font_Hash (uint64_t hash, const void *data, size_t size)
+{
+  const unsigned char *p = data;
+
+  while (size--)
+    hash = (hash ^ *p++) * 0x100000001b3ull;
+
+  return hash;
+}
+
+static uint64_t
+font_HashString (uint64_t hash, const char *string)
+{
+  /* The terminator keeps "ab", "c" apart from "a", "bc" */
+  return font_Hash (hash, string ? string : "", string ? strlen (string) + 1 : 1);
+}
+
+/* Stores the modification time and size of `path', or -1s if it is
+ * missing.  */
+static void
+font_FileStamp (const char *path, int64_t *stamp)
+{
+  struct stat st;
+
+  stamp[0] = stamp[1] = stamp[2] = -1;
+
+  if (0 == stat (path, &st))
+    {
+      stamp[0] = st.st_mtim.tv_sec;
+      stamp[1] = st.st_mtim.tv_nsec;
+      stamp[2] = st.st_size;
+    }
+}
+
+/* Hashes what fontconfig's answers depend on: its version, the variables
+ * it reads, and the state of the stamped files and directories.  */
+static uint64_t
+font_ConfigHash (void)
+{
+  static const char *variables[] =
+    {
+      "FONTCONFIG_FILE", "FONTCONFIG_PATH", "FONTCONFIG_SYSROOT",
+      "HOME", "XDG_CONFIG_HOME", "XDG_DATA_HOME"
+    };
+  uint64_t hash = 0xcbf29ce484222325ull;
+  int version;
+  size_t i;
+
+  version = FcGetVersion ();
+  hash = font_Hash (hash, &version, sizeof (version));
+
+  for (i = 0; i < sizeof (variables) / sizeof (variables[0]); ++i)
+    hash = font_HashString (hash, getenv (variables[i]));
+
+  for (i = 0; i < font_cacheStampCount; ++i)
+    {
+      int64_t stamp[3];
+
+      font_FileStamp (font_cacheStamps[i], stamp);
+
+      hash = font_HashString (hash, font_cacheStamps[i]);
+      hash = font_Hash (hash, stamp, sizeof (stamp));
+    }
+
+  return hash;
+}
+
+static void
+font_AddStamp (const char *path)
+{
+  size_t i;
+
+  for (i = 0; i < font_cacheStampCount; ++i)
+    {
+      if (!strcmp (font_cacheStamps[i], path))
+        return;
+    }
+
+  if (!(font_cacheStamps = realloc (font_cacheStamps, (font_cacheStampCount + 1) * sizeof (*font_cacheStamps)))
+      || !(font_cacheStamps[font_cacheStampCount] = strdup (path)))
+    err (EXIT_FAILURE, "Failed to allocate font cache");
+
+  ++font_cacheStampCount;
+}
+
+/* Records the configuration fontconfig has loaded.  Directories are
+ * included, as adding a file changes their modification time.  */
+static void
+font_StampConfig (void)
+{
+  FcConfig *config;
+  FcStrList *list;
+  FcChar8 *path;
+
+  config = FcConfigGetCurrent ();
+
+  if ((list = FcConfigGetConfigFiles (config)))
+    {
+      while ((path = FcStrListNext (list)))
+        {
+          char *directory, *slash;
+
+          font_AddStamp ((const char *) path);
+
+          if ((directory = strdup ((const char *) path))
+              && (slash = strrchr (directory, '/')) && slash != directory)
+            {
+              *slash = 0;
+              font_AddStamp (directory);
+            }
+
+          free (directory);
+        }
+
+      FcStrListDone (list);
+    }
+
+  /* This includes every subdirectory fontconfig scanned */
+  if ((list = FcConfigGetFontDirs (config)))
+    {
+      while ((path = FcStrListNext (list)))
+        font_AddStamp ((const char *) path);
+
+      FcStrListDone (list);
+    }
+
+  font_cacheHash = font_ConfigHash ();
+}
+
+static void
+font_FreeEntry (struct font_CacheEntry *entry)
+{
+  uint32_t i;
+
+  if (!entry)
+    return;
+
+  for (i = 0; i < entry->faceCount; ++i)
+    {
+      free (entry->faces[i].path);
+      free (entry->faces[i].ranges);
+    }
+
+  free (entry->faces);
+  free (entry->name);
+  free (entry);
+}
+
+static void
+font_AddEntry (struct font_CacheEntry *entry)
+{
+  if (font_cacheEntryCount == font_cacheEntryAlloc)
+    {
+      font_cacheEntryAlloc = font_cacheEntryAlloc ? font_cacheEntryAlloc * 2 : 16;
+
+      if (!(font_cacheEntries = realloc (font_cacheEntries, font_cacheEntryAlloc * sizeof (*font_cacheEntries))))
+        err (EXIT_FAILURE, "Failed to allocate font cache");
+    }
+
+  font_cacheEntries[font_cacheEntryCount++] = entry;
+}
+
+static void
+font_ClearCache (void)
+{
+  size_t i;
+
+  for (i = 0; i < font_cacheEntryCount; ++i)
+    font_FreeEntry (font_cacheEntries[i]);
+
+  font_cacheEntryCount = 0;
+
+  for (i = 0; i < font_cacheStampCount; ++i)
+    free (font_cacheStamps[i]);
+
+  free (font_cacheStamps);
+  font_cacheStamps = NULL;
+  font_cacheStampCount = 0;
+}
+
+static int
+font_ReadU32 (FILE *input, uint32_t *value)
+{
+  return (1 == fread (value, sizeof (*value), 1, input)) ? 0 : -1;
+}
+
+static char *
+font_ReadString (FILE *input)
+{
+  uint32_t length;
+  char *result;
+
+  if (-1 == font_ReadU32 (input, &length) || length > FONT_CACHE_MAX_STRING
+      || !(result = malloc (length + 1)))
+    return NULL;
+
+  if (length != fread (result, 1, length, input))
+    {
+      free (result);
+
+      return NULL;
+    }
+
+  result[length] = 0;
+
+  return result;
+}
+
+static struct font_CacheEntry *
+font_ReadEntry (FILE *input)
+{
+  struct font_CacheEntry *entry;
+  uint32_t i;
+
+  if (!(entry = calloc (1, sizeof (*entry))))
+    return NULL;
+
+  if (!(entry->name = font_ReadString (input))
+      || -1 == font_ReadU32 (input, &entry->size)
+      || -1 == font_ReadU32 (input, &entry->weight)
+      || 1 != fread (&entry->cost, sizeof (entry->cost), 1, input)
+      || -1 == font_ReadU32 (input, &entry->faceCount)
+      || entry->faceCount > 65536
+      || !(entry->faces = calloc (entry->faceCount + 1, sizeof (*entry->faces))))
+    goto fail;
+
+  for (i = 0; i < entry->faceCount; ++i)
+    {
+      struct font_CachedFace *face = &entry->faces[i];
+      uint32_t rangeCount;
+
+      if (!(face->path = font_ReadString (input))
+          || 1 != fread (face->stamp, sizeof (face->stamp), 1, input)
+          || -1 == font_ReadU32 (input, &rangeCount))
+        goto fail;
+
+      /* All ones marks unknown coverage */
+      if (rangeCount == UINT32_MAX)
+        continue;
+
+      if (rangeCount > 0x110000
+          || !(face->ranges = malloc ((rangeCount + 1) * sizeof (*face->ranges)))
+          || rangeCount != fread (face->ranges, sizeof (*face->ranges), rangeCount, input))
+        goto fail;
+
+      face->rangeCount = rangeCount;
+    }
+
+  return entry;
+
+fail:
+
+  font_FreeEntry (entry);
+
+  return NULL;
+}
+
+static void
+font_DefaultCachePath (void)
+{
+  const char *base;
+
+  font_cachePathSet = 1;
+
+  if ((base = getenv ("XDG_CACHE_HOME")) && *base)
+    {
+      if ((font_cachePath = malloc (strlen (base) + 32)))
+        sprintf (font_cachePath, "%s/bm-font-import/fonts", base);
+    }
+  else if ((base = getenv ("HOME")) && *base)
+    {
+      if ((font_cachePath = malloc (strlen (base) + 32)))
+        sprintf (font_cachePath, "%s/.cache/bm-font-import/fonts", base);
+    }
+}
+
+/* Loads the cache file, unless the configuration it was made with has
+ * changed since.  */
+static void
+font_LoadCache (void)
+{
+  struct font_CacheEntry *entry;
+  char magic[4];
+  uint32_t version, count, i;
+  uint64_t hash;
+  FILE *input;
+
+  font_cacheLoaded = 1;
+
+  if (!font_cachePathSet)
+    font_DefaultCachePath ();
+
+  if (!font_cachePath || !(input = fopen (font_cachePath, "rb")))
+    return;
+
+  if (4 != fread (magic, 1, 4, input) || memcmp (magic, FONT_CACHE_MAGIC, 4)
+      || -1 == font_ReadU32 (input, &version) || version != FONT_CACHE_VERSION
+      || 1 != fread (&hash, sizeof (hash), 1, input)
+      || -1 == font_ReadU32 (input, &count) || count > 65536)
+    goto done;
+
+  for (i = 0; i < count; ++i)
+    {
+      char *stamp;
+
+      if (!(stamp = font_ReadString (input)))
+        goto invalid;
+
+      font_AddStamp (stamp);
+      free (stamp);
+    }
+
+  if (hash != font_ConfigHash ())
+    goto invalid;
+
+  font_cacheHash = hash;
+
+  if (-1 == font_ReadU32 (input, &count))
+    goto invalid;
+
+  for (i = 0; i < count; ++i)
+    {
+      if (!(entry = font_ReadEntry (input)))
+        break;
+
+      font_AddEntry (entry);
+    }
+
+  goto done;
+
+invalid:
+
+  font_ClearCache ();
+
+done:
+
+  fclose (input);
+}
+
+static void
+font_WriteU32 (FILE *output, uint32_t value)
+{
+  fwrite (&value, sizeof (value), 1, output);
+}
+
+static void
+font_WriteString (FILE *output, const char *string)
+{
+  font_WriteU32 (output, strlen (string));
+  fwrite (string, 1, strlen (string), output);
+}
+
+static void
+font_MakeDirectories (const char *path)
+{
+  char *directory, *slash;
+
+  if (!(directory = strdup (path)))
+    return;
+
+  for (slash = strchr (directory + 1, '/'); slash; slash = strchr (slash + 1, '/'))
+    {
+      *slash = 0;
+      mkdir (directory, 0777);
+      *slash = '/';
+    }
+
+  free (directory);
+}
+
+/* Writes the cache file under a temporary name and renames it into place,
+ * so concurrent readers never see it half written.  Caching is disabled
+ * if this fails.  */
+static void
+font_SaveCache (void)
+{
+  char *temporaryPath;
+  FILE *output;
+  size_t i, j;
+
+  if (!font_cachePath)
+    return;
+
+  if (!(temporaryPath = malloc (strlen (font_cachePath) + 32)))
+    return;
+
+  sprintf (temporaryPath, "%s.tmp%ld", font_cachePath, (long) getpid ());
+
+  font_MakeDirectories (font_cachePath);
+
+  if (!(output = fopen (temporaryPath, "wb")))
+    goto fail;
+
+  fwrite (FONT_CACHE_MAGIC, 1, 4, output);
+  font_WriteU32 (output, FONT_CACHE_VERSION);
+  fwrite (&font_cacheHash, sizeof (font_cacheHash), 1, output);
+
+  font_WriteU32 (output, font_cacheStampCount);
+
+  for (i = 0; i < font_cacheStampCount; ++i)
+    font_WriteString (output, font_cacheStamps[i]);
+
+  font_WriteU32 (output, font_cacheEntryCount);
+
+  for (i = 0; i < font_cacheEntryCount; ++i)
+    {
+      const struct font_CacheEntry *entry = font_cacheEntries[i];
+
+      font_WriteString (output, entry->name);
+      font_WriteU32 (output, entry->size);
+      font_WriteU32 (output, entry->weight);
+      fwrite (&entry->cost, sizeof (entry->cost), 1, output);
+      font_WriteU32 (output, entry->faceCount);
+
+      for (j = 0; j < entry->faceCount; ++j)
+        {
+          const struct font_CachedFace *face = &entry->faces[j];
+
+          font_WriteString (output, face->path);
+          fwrite (face->stamp, sizeof (face->stamp), 1, output);
+
+          if (!face->ranges)
+            {
+              font_WriteU32 (output, UINT32_MAX);
+
+              continue;
+            }
+
+          font_WriteU32 (output, face->rangeCount);
+          fwrite (face->ranges, sizeof (*face->ranges), face->rangeCount, output);
+        }
+    }
+
+  if (ferror (output) | fclose (output)
+      || -1 == rename (temporaryPath, font_cachePath))
+    goto fail;
 
-#include <fontconfig/fontconfig.h>
-#include <ft2build.h>
-#include FT_FREETYPE_H
-#include FT_CACHE_H
+  free (temporaryPath);
 
-#include "font.h"
+  return;
 
-struct FONT_Data
+fail:
+
+  warn ("Failed to write font cache `%s'", font_cachePath);
+  unlink (temporaryPath);
+  free (temporaryPath);
+
+  free (font_cachePath);
+  font_cachePath = NULL;
+}
+
+/* Converts a fontconfig character set to sorted ranges */
+static void
+font_CoverageFromCharSet (struct font_CachedFace *face, const FcCharSet *charSet)
 {
-  FT_Face *faces;
-  size_t faceCount;
+  FcChar32 map[FC_CHARSET_MAP_SIZE], next, base;
+  size_t alloc = 0;
+  unsigned int i;
 
-  unsigned int spaceWidth;
-};
+  face->ranges = NULL;
+  face->rangeCount = 0;
 
-static FT_Library ft_library;
+  for (base = FcCharSetFirstPage (charSet, map, &next);
+       base != FC_CHARSET_DONE;
+       base = FcCharSetNextPage (charSet, map, &next))
+    {
+      for (i = 0; i < 256; ++i)
+        {
+          FcChar32 code = base + i;
 
-static FT_GlyphSlot
-font_FreeTypeGlyphForCharacter (struct FONT_Data *font, wint_t character,
-                                FT_Face *face, unsigned int loadFlags);
+          if (!(map[i / 32] & (1u << (i % 32))))
+            continue;
 
-void
-FONT_Init (void)
-{
-  int status;
+          if (face->rangeCount && face->ranges[face->rangeCount - 1].last + 1 == code)
+            {
+              face->ranges[face->rangeCount - 1].last = code;
 
-  if (0 != (status = FT_Init_FreeType (&ft_library)))
-    errx (EXIT_FAILURE, "Failed to initialize FreeType with status %d", status);
+              continue;
+            }
+
+          if (face->rangeCount == alloc)
+            {
+              alloc = alloc ? alloc * 2 : 64;
+
+              if (!(face->ranges = realloc (face->ranges, alloc * sizeof (*face->ranges))))
+                err (EXIT_FAILURE, "Failed to allocate coverage");
+            }
+
+          face->ranges[face->rangeCount].first = code;
+          face->ranges[face->rangeCount].last = code;
+          ++face->rangeCount;
+        }
+    }
+
+  /* Keep empty coverage apart from unknown coverage */
+  if (!face->ranges && !(face->ranges = malloc (sizeof (*face->ranges))))
+    err (EXIT_FAILURE, "Failed to allocate coverage");
 }
 
-int
-FONT_PathsForFont (char ***paths, const char *name, unsigned int size, unsigned int weight)
+/* Asks fontconfig for the fallback chain of a font */
+static struct font_CacheEntry *
+font_Resolve (const char *name, unsigned int size, unsigned int weight)
 {
+  struct font_CacheEntry *entry;
   FcPattern *pattern;
   FcCharSet *charSet;
   FcFontSet *fontSet;
   FcResult fcResult;
-  unsigned int i, result = 0;
+  uint64_t start;
+  int i;
+
+  start = font_Now ();
 
   if (!FcInit ())
-    return -1;
+    return NULL;
+
+  if (!font_cacheStampCount)
+    font_StampConfig ();
 
   pattern = FcNameParse ((FcChar8 *) name);
 
@@ -81,73 +897,248 @@ FONT_PathsForFont (char ***paths, const char *name, unsigned int size, unsigned
   FcPatternDestroy (pattern);
 
   if (!fontSet)
-    return -1;
+    return NULL;
 
-  *paths = calloc (fontSet->nfont, sizeof (**paths));
+  if (charSet)
+    FcCharSetDestroy (charSet);
+
+  if (!(entry = calloc (1, sizeof (*entry)))
+      || !(entry->name = strdup (name))
+      || !(entry->faces = calloc (fontSet->nfont + 1, sizeof (*entry->faces))))
+    err (EXIT_FAILURE, "Failed to allocate font cache");
+
+  entry->size = size;
+  entry->weight = weight;
 
   for (i = 0; i < fontSet->nfont; ++i)
     {
+      struct font_CachedFace *face;
+      FcCharSet *faceCharSet;
       FcChar8 *path = 0;
+      int index = 0;
 
       FcPatternGetString (fontSet->fonts[i], FC_FILE, 0, &path);
 
-      if (path)
+      if (!path)
+        continue;
+
+      face = &entry->faces[entry->faceCount++];
+
+      if (!(face->path = strdup ((const char *) path)))
+        err (EXIT_FAILURE, "Failed to allocate font cache");
+
+      font_FileStamp (face->path, face->stamp);
+
+      /* Only the first face of a collection is opened, so the coverage of
+       * the others does not apply.  */
+      FcPatternGetInteger (fontSet->fonts[i], FC_INDEX, 0, &index);
+
+      if (!index
+          && FcResultMatch == FcPatternGetCharSet (fontSet->fonts[i], FC_CHARSET, 0, &faceCharSet))
+        font_CoverageFromCharSet (face, faceCharSet);
+    }
+
+  FcFontSetDestroy (fontSet);
+
+  entry->cost = font_Now () - start;
+
+  return entry;
+}
+
+/* Forgets the coverage of faces whose files were changed in place, as
+ * fontconfig may not notice.  FreeType is then asked instead.  Returns
+ * nonzero if any face had changed.  */
+static int
+font_RefreshFaces (struct font_CacheEntry *entry)
+{
+  int64_t stamp[3];
+  int changed = 0;
+  uint32_t i;
+
+  for (i = 0; i < entry->faceCount; ++i)
+    {
+      struct font_CachedFace *face = &entry->faces[i];
+
+      font_FileStamp (face->path, stamp);
+
+      if (!memcmp (stamp, face->stamp, sizeof (stamp)))
+        continue;
+
+      memcpy (face->stamp, stamp, sizeof (stamp));
+      free (face->ranges);
+      face->ranges = NULL;
+      face->rangeCount = 0;
+      changed = 1;
+    }
+
+  return changed;
+}
+
+/* Returns the fallback chain of a font from the cache, or from fontconfig
+ * if it is not cached.  */
+static const struct font_CacheEntry *
+font_Lookup (const char *name, unsigned int size, unsigned int weight)
+{
+  struct font_CacheEntry *entry;
+  uint64_t start;
+  size_t i;
+
+  start = font_Now ();
+
+  if (!font_cacheLoaded)
+    font_LoadCache ();
+
+  /* The configuration and font files may change while the process runs,
+   * as with --watch.  Added or renamed files change their directory, and
+   * fontconfig is started again to see them.  */
+  if (font_cacheStampCount && font_ConfigHash () != font_cacheHash)
+    {
+      font_ClearCache ();
+      FcInitReinitialize ();
+    }
+
+  for (i = 0; i < font_cacheEntryCount; ++i)
+    {
+      entry = font_cacheEntries[i];
+
+      if (entry->size == size && entry->weight == weight
+          && !strcmp (entry->name, name))
         {
-          (*paths)[result] = malloc (strlen ((const char *) path) + 1);
-          strcpy ((*paths)[result], (const char *) path);
+          if (font_RefreshFaces (entry))
+            font_SaveCache ();
+
+          ++font_cacheHits;
+          font_cacheSaved += (entry->cost - (double) (font_Now () - start)) * 1e-9;
 
-          ++result;
+          return entry;
         }
     }
 
-  FcFontSetDestroy (fontSet);
+  ++font_cacheMisses;
 
-  return result;
+  if (!(entry = font_Resolve (name, size, weight)))
+    return NULL;
+
+  font_AddEntry (entry);
+  font_SaveCache ();
+
+  return entry;
+}
+
+int
+FONT_PathsForFont (char ***paths, const char *name, unsigned int size, unsigned int weight)
+{
+  const struct font_CacheEntry *entry;
+  uint32_t i;
+
+  if (!(entry = font_Lookup (name, size, weight)))
+    return -1;
+
+  if (!(*paths = calloc (entry->faceCount + 1, sizeof (**paths))))
+    return -1;
+
+  for (i = 0; i < entry->faceCount; ++i)
+    {
+      if (!((*paths)[i] = strdup (entry->faces[i].path)))
+        {
+          while (i--)
+            free ((*paths)[i]);
+
+          free (*paths);
+          *paths = NULL;
+
+          return -1;
+        }
+    }
+
+  return entry->faceCount;
+}
+
+static FT_Size
+font_PrimarySize (struct FONT_Context *context, struct FONT_Data *font)
+{
+  FTC_ScalerRec scaler;
+  FT_Size size;
+
+  scaler.face_id = &font->faceIDs[0];
+  scaler.width = 0;
+  scaler.height = font->size;
+  scaler.pixel = 1;
+  scaler.x_res = 0;
+  scaler.y_res = 0;
+
+  if (0 != FTC_Manager_LookupSize (context->cacheManager, &scaler, &size))
+    return NULL;
+
+  return size;
 }
 
 struct FONT_Data *
 FONT_Load (const char *name, unsigned int size, unsigned int weight)
 {
+  const struct font_CacheEntry *entry;
   struct FONT_Data *result;
-  FT_GlyphSlot tmpGlyph;
-  char **paths;
-  int i, pathCount;
+  struct FONT_Glyph *space;
+  FT_Size primarySize;
+  FT_Face face;
+  int i;
   int ok = 0;
 
-  pathCount = FONT_PathsForFont (&paths, name, size, weight);
-
-  if (pathCount <= 0)
+  if (!(entry = font_Lookup (name, size, weight)) || !entry->faceCount)
     return NULL;
 
   result = calloc (1, sizeof (*result));
+  result->size = size;
 
-  if (!(result->faces = calloc (pathCount, sizeof (*result->faces))))
+  if (!(result->faceIDs = calloc (entry->faceCount, sizeof (*result->faceIDs))))
     goto fail;
 
-  result->faceCount = 0;
-
-  for (i = 0; i < pathCount; ++i)
+  for (i = 0; i < entry->faceCount; ++i)
     {
-      FT_Face face;
-      int ret;
+      if (!(result->faceIDs[i].path = strdup (entry->faces[i].path)))
+        goto fail;
 
-      if (0 != (ret = FT_New_Face (ft_library, paths[i], 0, &face)))
+      /* Copied, as the cache entry may be refreshed while the font is in
+       * use.  */
+      if (entry->faces[i].ranges)
         {
-          fprintf (stderr, "FT_New_Face on %s failed with code %d\n", paths[i], ret);
+          size_t rangeSize = entry->faces[i].rangeCount * sizeof (struct font_Range);
 
-          continue;
+          if (!(result->faceIDs[i].ranges = malloc (rangeSize ? rangeSize : 1)))
+            {
+              free (result->faceIDs[i].path);
+
+              goto fail;
+            }
+
+          memcpy (result->faceIDs[i].ranges, entry->faces[i].ranges, rangeSize);
+          result->faceIDs[i].rangeCount = entry->faces[i].rangeCount;
         }
 
-      if (0 != (ret = FT_Set_Pixel_Sizes (face, 0, size)))
-        {
-          FT_Done_Face (face);
+      ++result->faceCount;
+    }
 
-          fprintf (stderr, "FT_New_Face on %s failed with code %d\n", paths[i], ret);
+  if (!(result->context = font_NewContext (ft_library, &font_memory)))
+    {
+      fprintf (stderr, "Failed to create glyph cache for `%s'\n", name);
 
-          continue;
-        }
+      goto fail;
+    }
 
-      result->faces[result->faceCount++] = face;
+  /* Faces are opened lazily by the cache manager, but the primary face
+   * provides the metrics, so drop leading faces that fail to open.  */
+  while (result->faceCount
+         && 0 != FTC_Manager_LookupFace (result->context->cacheManager,
+                                         &result->faceIDs[0], &face))
+    {
+      free (result->faceIDs[0].path);
+      free (result->faceIDs[0].ranges);
+
+      --result->faceCount;
+      memmove (result->faceIDs, result->faceIDs + 1,
+               result->faceCount * sizeof (*result->faceIDs));
+
+      FTC_Manager_Reset (result->context->cacheManager);
     }
 
   if (!result->faceCount)
@@ -157,8 +1148,28 @@ FONT_Load (const char *name, unsigned int size, unsigned int weight)
       goto fail;
     }
 
-  tmpGlyph = font_FreeTypeGlyphForCharacter (result, ' ', NULL, 0);
-  result->spaceWidth = tmpGlyph->advance.x >> 6;
+  result->faceIDs[0].used = 1;
+
+  /* Metrics are read once, so that other threads never need the font's
+   * own context.  */
+  if ((primarySize = font_PrimarySize (result->context, result)))
+    {
+      result->ascent = primarySize->metrics.ascender >> 6;
+      result->descent = -primarySize->metrics.descender >> 6;
+      result->lineHeight = primarySize->metrics.height >> 6;
+    }
+
+  if (!(space = FONT_GlyphForCharacter (result, ' ')))
+    goto fail;
+
+  result->spaceWidth = space->xOffset;
+  free (space);
+
+  if (!(space = font_GlyphAt (result->context, result, ' ', 0)))
+    goto fail;
+
+  result->spaceAdvance = space->xAdvance;
+  free (space);
 
   ok = 1;
 
@@ -166,14 +1177,23 @@ fail:
 
   if (!ok)
     {
+      if (result->context)
+        FONT_FreeContext (result->context);
+
+      if (result->faceIDs)
+        {
+          for (i = 0; i < result->faceCount; ++i)
+            {
+              free (result->faceIDs[i].path);
+              free (result->faceIDs[i].ranges);
+            }
+        }
+
+      free (result->faceIDs);
       free (result);
       result = NULL;
     }
 
-  for (i = 0; i < pathCount; ++i)
-    free (paths[i]);
-  free (paths);
-
   return result;
 }
 
@@ -182,37 +1202,56 @@ FONT_Free (struct FONT_Data *font)
 {
   int i;
 
+  FONT_FreeContext (font->context);
+
+  for (i = 0; i < font->faceCount; ++i)
+    {
+      free (font->faceIDs[i].path);
+      free (font->faceIDs[i].ranges);
+    }
+
+  free (font->faceIDs);
+  free (font);
+}
+
+void
+FONT_CacheStatistics (struct FONT_Data *font,
+                      unsigned long *hits, unsigned long *misses,
+                      unsigned long *uncached)
+{
+  FONT_ContextStatistics (font->context, hits, misses, uncached);
+}
+
+const char *
+FONT_UsedFacePath (struct FONT_Data *font, unsigned int index)
+{
+  size_t i;
+
   for (i = 0; i < font->faceCount; ++i)
-    FT_Done_Face (font->faces[i]);
+    {
+      if (font->faceIDs[i].used && !index--)
+        return font->faceIDs[i].path;
+    }
 
-  free (font->faces);
+  return NULL;
 }
 
 unsigned int
 FONT_Ascent (struct FONT_Data *font)
 {
-  if (!font->faceCount)
-    return 0.0;
-
-  return font->faces[0]->size->metrics.ascender >> 6;
+  return font->ascent;
 }
 
 unsigned int
 FONT_Descent (struct FONT_Data *font)
 {
-  if (!font->faceCount)
-    return 0.0;
-
-  return -font->faces[0]->size->metrics.descender >> 6;
+  return font->descent;
 }
 
 unsigned int
 FONT_LineHeight (struct FONT_Data *font)
 {
-  if (!font->faceCount)
-    return 0.0;
-
-  return font->faces[0]->size->metrics.height >> 6;
+  return font->lineHeight;
 }
 
 unsigned int
@@ -221,43 +1260,162 @@ FONT_SpaceWidth (struct FONT_Data *font)
   return font->spaceWidth;
 }
 
+int
+FONT_SpaceAdvance (struct FONT_Data *font)
+{
+  return font->spaceAdvance;
+}
+
+/* Returns zero if fontconfig says the face lacks `character'.  Its
+ * coverage includes every character FreeType maps, so faces can be
+ * skipped without opening them.  */
+static int
+font_MayCover (const struct font_FaceID *id, wint_t character)
+{
+  uint32_t first = 0, count = id->rangeCount;
+
+  if (!id->ranges)
+    return 1;
+
+  while (count > 0)
+    {
+      uint32_t half = count / 2;
+
+      if (id->ranges[first + half].last < (uint32_t) character)
+        {
+          first += half + 1;
+          count -= half + 1;
+        }
+      else
+        count = half;
+    }
+
+  return first < id->rangeCount && id->ranges[first].first <= (uint32_t) character;
+}
+
+/* Finds the first face in the fallback chain covering `character' */
+static FT_UInt
+font_GlyphIndex (struct FONT_Context *context, struct FONT_Data *font,
+                 wint_t character, FTC_FaceID *faceID)
+{
+  int faceIndex;
+
+  for (faceIndex = 0; faceIndex < font->faceCount; ++faceIndex)
+    {
+      FT_UInt glyphIndex;
+      FT_Face face;
+
+      if (!font_MayCover (&font->faceIDs[faceIndex], character))
+        continue;
+
+      if (0 != FTC_Manager_LookupFace (context->cacheManager,
+                                       &font->faceIDs[faceIndex], &face))
+        continue;
+
+      if (0 != (glyphIndex = FT_Get_Char_Index (face, character)))
+        {
+          /* Other contexts may run on other threads, so only the font's
+           * own context records which faces were used.  */
+          if (context == font->context)
+            font->faceIDs[faceIndex].used = 1;
+
+          *faceID = &font->faceIDs[faceIndex];
+
+          return glyphIndex;
+        }
+    }
+
+  /* No face covers the character; use the primary face's .notdef glyph */
+  *faceID = &font->faceIDs[0];
+
+  return 0;
+}
+
+struct FONT_Glyph *
+FONT_ContextGlyphForCharacter (struct FONT_Context *context,
+                               struct FONT_Data *font, wint_t character)
+{
+  FTC_FaceID faceID;
+  FT_UInt glyphIndex;
+
+  glyphIndex = font_GlyphIndex (context, font, character, &faceID);
+
+  return font_GlyphForIndex (context, font, faceID, glyphIndex);
+}
+
 struct FONT_Glyph *
 FONT_GlyphForCharacter (struct FONT_Data *font, wint_t character)
+{
+  return FONT_ContextGlyphForCharacter (font->context, font, character);
+}
+
+static struct FONT_Glyph *
+font_GlyphAt (struct FONT_Context *context, struct FONT_Data *font,
+              wint_t character, int xShift)
 {
   struct FONT_Glyph *result;
+  FTC_ScalerRec scaler;
   FT_GlyphSlot glyph;
-  FT_Face face;
-  unsigned int y, x, i;
+  FT_UInt glyphIndex;
+  FT_Size size;
 
-  if (!(glyph = font_FreeTypeGlyphForCharacter (font, character, &face, 0)))
+  scaler.width = 0;
+  scaler.height = font->size;
+  scaler.pixel = 1;
+  scaler.x_res = 0;
+  scaler.y_res = 0;
+
+  glyphIndex = font_GlyphIndex (context, font, character, &scaler.face_id);
+
+  if (0 != FTC_Manager_LookupSize (context->cacheManager, &scaler, &size))
+    return NULL;
+
+  glyph = size->face->glyph;
+
+  if (0 != FT_Load_Glyph (size->face, glyphIndex, FT_LOAD_TARGET_LIGHT))
     return NULL;
 
-  assert (!(glyph->bitmap.width % 3));
+  if (glyph->format == FT_GLYPH_FORMAT_OUTLINE)
+    FT_Outline_Translate (&glyph->outline, xShift, 0);
 
-  glyph->bitmap.width /= 3;
+  if (0 != FT_Render_Glyph (glyph, FT_RENDER_MODE_LCD))
+    return NULL;
 
-  if (!(result = FONT_GlyphWithSize (glyph->bitmap.width, glyph->bitmap.rows)))
+  if (!(result = font_GlyphFromLCDBitmap (glyph->bitmap.buffer,
+                                          glyph->bitmap.pitch,
+                                          glyph->bitmap.width,
+                                          glyph->bitmap.rows)))
     return NULL;
 
   result->x = -glyph->bitmap_left;
   result->y = glyph->bitmap_top;
-  result->xOffset = (glyph->advance.x + 32) >> 6;
+  result->xAdvance = (glyph->linearHoriAdvance + 0x200) >> 10;
+  result->xOffset = (result->xAdvance + 32) >> 6;
   result->yOffset = (glyph->advance.y + 32) >> 6;
 
-  for (y = 0, i = 0; y < result->height; ++y)
-    {
-      for (x = 0; x < result->width; ++x, i += 4)
-        {
-          result->data[i + 0] = glyph->bitmap.buffer[y * glyph->bitmap.pitch + x * 3 + 0];
-          result->data[i + 1] = glyph->bitmap.buffer[y * glyph->bitmap.pitch + x * 3 + 1];
-          result->data[i + 2] = glyph->bitmap.buffer[y * glyph->bitmap.pitch + x * 3 + 2];
-          result->data[i + 3] = (result->data[i] + result->data[i + 1] + result->data[i + 2]) / 3;
-        }
-    }
+  return result;
+}
+
+struct FONT_Glyph *
+FONT_ContextGlyphForCharacterAt (struct FONT_Context *context,
+                                 struct FONT_Data *font, wint_t character,
+                                 int xShift)
+{
+  struct FONT_Glyph *result;
+
+  /* These bypass the caches, so are not counted as hits or misses */
+  if ((result = font_GlyphAt (context, font, character, xShift)))
+    ++context->uncachedRenders;
 
   return result;
 }
 
+struct FONT_Glyph *
+FONT_GlyphForCharacterAt (struct FONT_Data *font, wint_t character, int xShift)
+{
+  return FONT_ContextGlyphForCharacterAt (font->context, font, character, xShift);
+}
+
 struct FONT_Glyph *
 FONT_GlyphWithSize (unsigned int width, unsigned int height)
 {
@@ -270,29 +1428,99 @@ FONT_GlyphWithSize (unsigned int width, unsigned int height)
   return result;
 }
 
-static FT_GlyphSlot
-font_FreeTypeGlyphForCharacter (struct FONT_Data *font, wint_t character,
-                                FT_Face *face, unsigned int loadFlags)
-
+static struct FONT_Glyph *
+font_GlyphFromLCDBitmap (const FT_Byte *buffer, int pitch,
+                         unsigned int width, unsigned int rows)
 {
-  int faceIndex;
+  struct FONT_Glyph *result;
+  unsigned int y, x, i;
 
-  for (faceIndex = 0; faceIndex < font->faceCount; ++faceIndex)
-    {
-      FT_Face currentFace;
+  assert (!(width % 3));
 
-      currentFace = font->faces[faceIndex];
+  if (!(result = FONT_GlyphWithSize (width / 3, rows)))
+    return NULL;
 
-      if (!FT_Load_Char (currentFace, character, loadFlags))
+  for (y = 0, i = 0; y < result->height; ++y)
+    {
+      for (x = 0; x < result->width; ++x, i += 4)
         {
-          FT_Render_Glyph (currentFace->glyph, FT_RENDER_MODE_LCD);
+          result->data[i + 0] = buffer[y * pitch + x * 3 + 0];
+          result->data[i + 1] = buffer[y * pitch + x * 3 + 1];
+          result->data[i + 2] = buffer[y * pitch + x * 3 + 2];
+          result->data[i + 3] = (result->data[i] + result->data[i + 1] + result->data[i + 2]) / 3;
+        }
+    }
 
-          if (face)
-            *face = currentFace;
+  return result;
+}
 
-          return currentFace->glyph;
-        }
+static struct FONT_Glyph *
+font_GlyphForIndex (struct FONT_Context *context, struct FONT_Data *font,
+                    FTC_FaceID faceID, FT_UInt glyphIndex)
+{
+  struct FONT_Glyph *result;
+  FTC_ImageTypeRec imageType;
+  FTC_SBit sbit;
+  FT_BitmapGlyph image;
+  unsigned long allocations;
+  FT_Face face;
+
+  imageType.face_id = faceID;
+  imageType.width = 0;
+  imageType.height = font->size;
+  imageType.flags = FONT_LOAD_FLAGS;
+
+  if (0 != FTC_Manager_LookupFace (context->cacheManager, faceID, &face))
+    return NULL;
+
+  /* The caches do not report whether a lookup was satisfied from memory,
+   * but a miss allocates room for the new glyph, and a hit allocates
+   * nothing.  Blank glyphs need no room, so they may count as hits.  */
+  allocations = context->memory->allocations;
+
+  if (font->size <= FONT_SBIT_MAX_SIZE
+      && 0 != FTC_SBitCache_Lookup (context->sbitCache, &imageType, glyphIndex,
+                                    &sbit, NULL))
+    return NULL;
+
+  if (font->size <= FONT_SBIT_MAX_SIZE
+      && (sbit->buffer || sbit->width != 255))
+    {
+      if (!(result = font_GlyphFromLCDBitmap (sbit->buffer, sbit->pitch,
+                                              sbit->width, sbit->height)))
+        return NULL;
+
+      result->x = -sbit->left;
+      result->y = sbit->top;
+      result->xOffset = sbit->xadvance;
+      result->xAdvance = sbit->xadvance << 6;
+      result->yOffset = sbit->yadvance;
+    }
+  else
+    {
+      /* Too large for the small bitmap cache */
+      if (0 != FTC_ImageCache_Lookup (context->imageCache, &imageType, glyphIndex,
+                                      (FT_Glyph *) &image, NULL)
+          || image->root.format != FT_GLYPH_FORMAT_BITMAP)
+        return NULL;
+
+      if (!(result = font_GlyphFromLCDBitmap (image->bitmap.buffer,
+                                              image->bitmap.pitch,
+                                              image->bitmap.width,
+                                              image->bitmap.rows)))
+        return NULL;
+
+      result->x = -image->left;
+      result->y = image->top;
+      result->xOffset = (image->root.advance.x + 0x8000) >> 16;
+      result->xAdvance = result->xOffset << 6;
+      result->yOffset = (image->root.advance.y + 0x8000) >> 16;
     }
 
-  return 0;
+  if (context->memory->allocations == allocations)
+    ++context->cacheHits;
+  else
+    ++context->cacheMisses;
+
+  return result;
 }
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <wchar.h>
 
+struct FONT_Context;
 struct FONT_Data;
 
 struct FONT_Glyph
@@ -11,6 +12,7 @@ struct FONT_Glyph
   uint16_t width, height;
   int16_t  x, y;
   int16_t  xOffset, yOffset;
+  int32_t  xAdvance; /* 26.6 fixed point */
 
   uint8_t data[1];
 };
@@ -20,6 +22,23 @@ struct FONT_Glyph
 void
 FONT_Init (void);
 
+/* Sets the budgets of the glyph cache used by subsequently loaded fonts */
+void
+FONT_SetCacheLimits (unsigned int maxFaces, unsigned int maxSizes,
+                     unsigned long maxBytes);
+
+/* Sets the file where the fallback chains chosen by fontconfig are kept
+ * between runs.  NULL keeps them in memory only.  The default is
+ * $XDG_CACHE_HOME/bm-font-import/fonts.  */
+void
+FONT_SetResolutionCache (const char *path);
+
+/* Reports fallback chain lookups answered from the cache, those that
+ * needed fontconfig, and the time the cache saved.  */
+void
+FONT_ResolutionStatistics (unsigned long *hits, unsigned long *misses,
+                           double *secondsSaved);
+
 int
 FONT_PathsForFont (char ***paths, const char *name, unsigned int size, unsigned int weight);
 
@@ -29,6 +48,18 @@ FONT_Load (const char *name, unsigned int size, unsigned int weight);
 void
 FONT_Free (struct FONT_Data *font);
 
+/* Reports glyph cache hits and misses, and the glyphs rendered at a
+ * subpixel position, which are never cached.  */
+void
+FONT_CacheStatistics (struct FONT_Data *font,
+                      unsigned long *hits, unsigned long *misses,
+                      unsigned long *uncached);
+
+/* Returns the path of the `index'th face of the fallback chain that has
+ * provided glyphs or metrics so far, or NULL if there are no more.  */
+const char *
+FONT_UsedFacePath (struct FONT_Data *font, unsigned int index);
+
 unsigned int
 FONT_Ascent (struct FONT_Data *font);
 
@@ -38,12 +69,53 @@ FONT_Descent (struct FONT_Data *font);
 unsigned int
 FONT_LineHeight (struct FONT_Data *font);
 
+/* Advance of the space in whole pixels, as FONT_GlyphForCharacter
+ * returns it */
 unsigned int
 FONT_SpaceWidth (struct FONT_Data *font);
 
+/* Unhinted advance of the space in 26.6 fixed point, as
+ * FONT_GlyphForCharacterAt returns it */
+int
+FONT_SpaceAdvance (struct FONT_Data *font);
+
 struct FONT_Glyph *
 FONT_GlyphForCharacter (struct FONT_Data *font, wint_t character);
 
+/* Renders the glyph with its outline shifted right by `xShift' (26.6 fixed
+ * point, 0 to 63), for positioning at fractional pen positions.  The glyph
+ * is hinted vertically only, its advance is unhinted, and it is not
+ * cached.  Even at an `xShift' of 0 it may differ from the fully hinted
+ * glyph of FONT_GlyphForCharacter.  */
+struct FONT_Glyph *
+FONT_GlyphForCharacterAt (struct FONT_Data *font, wint_t character, int xShift);
+
+/* A render context owns its own FreeType library and glyph cache.  Each
+ * thread rendering in parallel needs a context of its own, while loaded
+ * fonts may be shared between threads for reading.  Fonts must outlive the
+ * contexts that rendered them.  FONT_Load, FONT_Free and the functions
+ * without a context argument share one library, so only one thread may
+ * call them at a time.  */
+struct FONT_Context *
+FONT_NewContext (void);
+
+void
+FONT_FreeContext (struct FONT_Context *context);
+
+void
+FONT_ContextStatistics (struct FONT_Context *context,
+                        unsigned long *hits, unsigned long *misses,
+                        unsigned long *uncached);
+
+struct FONT_Glyph *
+FONT_ContextGlyphForCharacter (struct FONT_Context *context,
+                               struct FONT_Data *font, wint_t character);
+
+struct FONT_Glyph *
+FONT_ContextGlyphForCharacterAt (struct FONT_Context *context,
+                                 struct FONT_Data *font, wint_t character,
+                                 int xShift);
+
 struct FONT_Glyph *
 FONT_GlyphWithSize (unsigned int width, unsigned int height);
 
@@ -32,41 +32,402 @@ struct glyph_Data
   uint16_t width, height;
   int16_t  x, y;
   int16_t  xOffset, yOffset;
+  int32_t  xAdvance;
   int16_t  u, v;
 };
 
+/* A bitmap already packed into the atlas, for detecting duplicates */
+struct glyph_Bitmap
+{
+  uint32_t hash;
+  uint16_t width, height;
+  int16_t  u, v;
+};
+
+/* One font sharing the atlas */
+struct glyph_Font
+{
+  uint16_t ascent, descent, lineHeight, spaceWidth;
+
+  struct glyph_Data *glyphs; /* 65536 entries per subpixel position */
+  uint32_t loadedGlyphs[65536 / 32];
+};
+
 static uint32_t *bitmap;
-static struct glyph_Data glyphs[65536]; /* 1 MB */
-static uint32_t loadedGlyphs[65536 / 32];
-static unsigned int top[GLYPH_ATLAS_SIZE];
+static unsigned int atlasSize;
+static unsigned int *top;
+static struct glyph_Font *fonts;
+static unsigned int fontCount;
+static unsigned int variantCount = 1;
+static enum COMPRESS_Format pixelFormat = COMPRESS_RGBA;
+static unsigned int mipLevels = 1;
+static enum MIPMAP_Filter mipFilter = MIPMAP_BOX;
+static unsigned int alignment = 1, padding;
+static struct COMPRESS_Error compressionError;
 static int glyph_dirty;
 
+static struct glyph_Bitmap *bitmaps;
+static size_t bitmapCount, bitmapAlloc;
+static unsigned int duplicateCount;
+static size_t duplicateBytes;
+
+/* Receives chunks as glyphs are packed, for the stream format */
+static FILE *glyph_stream;
+
+static void
+glyph_WriteS16 (FILE *output, int v);
+
+static void
+glyph_WriteU32 (FILE *output, uint32_t v);
+
+static void
+glyph_WriteRecord (FILE *output, unsigned int font, size_t i);
+
+void
+GLYPH_Init (unsigned int size)
+{
+  atlasSize = size;
+
+  if (!(bitmap = calloc (sizeof (*bitmap), atlasSize * atlasSize))
+      || !(top = calloc (sizeof (*top), atlasSize)))
+    err (EXIT_FAILURE, "Failed to allocate %ux%u atlas", atlasSize, atlasSize);
+}
+
 void
-GLYPH_Init (void)
+GLYPH_Reset (void)
 {
-  bitmap = calloc (sizeof (*bitmap), GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE);
+  unsigned int i;
+
+  for (i = 0; i < fontCount; ++i)
+    free (fonts[i].glyphs);
+
+  free (fonts);
+  free (bitmap);
+  free (top);
+  free (bitmaps);
+
+  fonts = NULL;
+  fontCount = 0;
+  bitmap = NULL;
+  top = NULL;
+  atlasSize = 0;
+
+  bitmaps = NULL;
+  bitmapCount = 0;
+  bitmapAlloc = 0;
+  duplicateCount = 0;
+  duplicateBytes = 0;
+
+  memset (&compressionError, 0, sizeof (compressionError));
+
+  glyph_stream = NULL;
 }
 
 void
-GLYPH_Add (unsigned int code, struct FONT_Glyph *glyph)
+GLYPH_SetStream (FILE *output)
+{
+  if (fontCount)
+    errx (EXIT_FAILURE, "The stream must be set before adding fonts");
+
+  glyph_stream = output;
+}
+
+static void
+glyph_WriteChunkHeader (FILE *output, const char *type, uint32_t length)
+{
+  glyph_WriteU32 (output, length);
+  fwrite (type, 1, 4, output);
+}
+
+/* Writes the pixels of a newly packed glyph.  Compressed tiles cover whole
+ * blocks, which only ever hold this glyph and the zeroed space around it.  */
+static void
+glyph_WriteTile (unsigned int u, unsigned int v, unsigned int width,
+                 unsigned int height)
 {
-  if (code >= sizeof (glyphs) / sizeof (glyphs[0]))
-    return;
+  struct COMPRESS_Error error;
+  uint8_t *rgba, *encoded;
+  size_t size;
+  unsigned int k;
+
+  if (pixelFormat != COMPRESS_RGBA)
+    {
+      width = (width + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE * COMPRESS_BLOCK_SIZE;
+      height = (height + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE * COMPRESS_BLOCK_SIZE;
+    }
 
-  loadedGlyphs[code >> 5] |= (1 << (code & 31));
+  size = COMPRESS_Size (pixelFormat, width, height);
+
+  if (!(rgba = malloc ((size_t) width * height * 4)) || !(encoded = malloc (size)))
+    err (EXIT_FAILURE, "Failed to allocate %ux%u tile", width, height);
+
+  for (k = 0; k < height; ++k)
+    memcpy (rgba + k * width * 4, bitmap + (v + k) * atlasSize + u, width * 4);
+
+  COMPRESS_Encode (pixelFormat, rgba, width, height, encoded, &error);
+
+  compressionError.squaredError += error.squaredError;
+  compressionError.samples += error.samples;
+  compressionError.blocks += error.blocks;
+
+  glyph_WriteChunkHeader (glyph_stream, "TILE", 8 + size);
+  glyph_WriteS16 (glyph_stream, u);
+  glyph_WriteS16 (glyph_stream, v);
+  glyph_WriteS16 (glyph_stream, width);
+  glyph_WriteS16 (glyph_stream, height);
+  fwrite (encoded, 1, size, glyph_stream);
+
+  free (encoded);
+  free (rgba);
+}
+
+void
+GLYPH_SetSubpixelPositions (unsigned int count)
+{
+  if (fontCount)
+    errx (EXIT_FAILURE, "Subpixel positions must be set before adding fonts");
+
+  variantCount = count;
+}
+
+/* Spaces glyphs so that no texel of the smallest mip level, and no
+ * compressed block at any level, mixes two glyphs.  */
+static void
+glyph_UpdateLayout (void)
+{
+  alignment = 1 << (mipLevels - 1);
+
+  if (pixelFormat != COMPRESS_RGBA)
+    alignment *= COMPRESS_BLOCK_SIZE;
+
+  padding = (mipLevels > 1) ? MIPMAP_Footprint (mipFilter) << (mipLevels - 1) : 0;
+}
+
+void
+GLYPH_SetPixelFormat (enum COMPRESS_Format format)
+{
+  if (fontCount)
+    errx (EXIT_FAILURE, "Pixel format must be set before adding fonts");
+
+  if (format != COMPRESS_RGBA && (atlasSize % COMPRESS_BLOCK_SIZE))
+    errx (EXIT_FAILURE, "Atlas size %u is not a multiple of the %u pixel block size",
+          atlasSize, COMPRESS_BLOCK_SIZE);
+
+  pixelFormat = format;
+  glyph_UpdateLayout ();
+}
+
+void
+GLYPH_SetMipLevels (unsigned int levels, enum MIPMAP_Filter filter)
+{
+  if (fontCount)
+    errx (EXIT_FAILURE, "Mip levels must be set before adding fonts");
+
+  if (levels < 1 || (atlasSize >> (levels - 1)) < 1)
+    errx (EXIT_FAILURE, "A %ux%u atlas cannot have %u mip levels", atlasSize, atlasSize, levels);
+
+  mipLevels = levels;
+  mipFilter = filter;
+  glyph_UpdateLayout ();
+}
+
+unsigned int
+GLYPH_AddFont (struct FONT_Data *data)
+{
+  struct glyph_Font *font;
+
+  if (fontCount == GLYPH_MAX_FONTS)
+    errx (EXIT_FAILURE, "Too many fonts in atlas (maximum is %u)", GLYPH_MAX_FONTS);
+
+  if (!(fonts = realloc (fonts, (fontCount + 1) * sizeof (*fonts))))
+    err (EXIT_FAILURE, "Failed to allocate font %u", fontCount);
+
+  font = &fonts[fontCount];
+  memset (font, 0, sizeof (*font));
+
+  if (!(font->glyphs = calloc (65536 * variantCount, sizeof (*font->glyphs))))
+    err (EXIT_FAILURE, "Failed to allocate glyphs for font %u", fontCount);
+
+  font->ascent = FONT_Ascent (data);
+  font->descent = FONT_Descent (data);
+  font->lineHeight = FONT_LineHeight (data);
+
+  /* The space advances like the glyphs around it */
+  if (variantCount == 1)
+    font->spaceWidth = FONT_SpaceWidth (data);
+  else
+    font->spaceWidth = (FONT_SpaceAdvance (data) + 32) >> 6;
+
+  if (glyph_stream)
+    {
+      if (!fontCount)
+        {
+          fwrite ("BMFS", 1, 4, glyph_stream);
+          glyph_WriteChunkHeader (glyph_stream, "HEAD", 6);
+          glyph_WriteS16 (glyph_stream, atlasSize);
+          glyph_WriteS16 (glyph_stream, variantCount);
+          glyph_WriteS16 (glyph_stream, pixelFormat);
+        }
+
+      glyph_WriteChunkHeader (glyph_stream, "FONT", 10);
+      glyph_WriteS16 (glyph_stream, fontCount);
+      glyph_WriteS16 (glyph_stream, font->ascent);
+      glyph_WriteS16 (glyph_stream, font->descent);
+      glyph_WriteS16 (glyph_stream, font->lineHeight);
+      glyph_WriteS16 (glyph_stream, font->spaceWidth);
+    }
+
+  return fontCount++;
+}
+
+static uint32_t
+glyph_Hash (const struct FONT_Glyph *glyph)
+{
+  const uint8_t *data;
+  uint32_t result = 2166136261u;
+  size_t i, size;
+
+  result = (result ^ glyph->width) * 16777619u;
+  result = (result ^ glyph->height) * 16777619u;
+
+  data = glyph->data;
+  size = glyph->width * glyph->height * 4;
+
+  for (i = 0; i < size; ++i)
+    result = (result ^ data[i]) * 16777619u;
+
+  return result;
+}
+
+/* Returns the packed bitmap identical to `glyph', or the empty slot where it
+ * should be recorded.  */
+static struct glyph_Bitmap *
+glyph_FindBitmap (const struct FONT_Glyph *glyph, uint32_t hash)
+{
+  size_t i, k;
+
+  for (i = hash & (bitmapAlloc - 1); ; i = (i + 1) & (bitmapAlloc - 1))
+    {
+      struct glyph_Bitmap *b = &bitmaps[i];
+
+      if (!b->width)
+        return b;
+
+      if (b->hash != hash || b->width != glyph->width || b->height != glyph->height)
+        continue;
+
+      for (k = 0; k < glyph->height; ++k)
+        {
+          if (memcmp (bitmap + (b->v + k) * atlasSize + b->u,
+                      glyph->data + (k * glyph->width) * 4,
+                      glyph->width * 4))
+            break;
+        }
+
+      if (k == glyph->height)
+        return b;
+    }
+}
+
+static void
+glyph_AddBitmap (const struct FONT_Glyph *glyph, uint32_t hash,
+                 unsigned int u, unsigned int v)
+{
+  struct glyph_Bitmap *b;
+
+  /* Keep the table at most half full */
+  if ((bitmapCount + 1) * 2 > bitmapAlloc)
+    {
+      struct glyph_Bitmap *old = bitmaps;
+      size_t i, oldAlloc = bitmapAlloc;
+
+      bitmapAlloc = bitmapAlloc ? bitmapAlloc * 2 : 256;
+
+      if (!(bitmaps = calloc (bitmapAlloc, sizeof (*bitmaps))))
+        err (EXIT_FAILURE, "Failed to allocate %zu bitmap hash entries", bitmapAlloc);
+
+      for (i = 0; i < oldAlloc; ++i)
+        {
+          size_t j;
+
+          if (!old[i].width)
+            continue;
+
+          for (j = old[i].hash & (bitmapAlloc - 1); bitmaps[j].width; j = (j + 1) & (bitmapAlloc - 1))
+            ;
+
+          bitmaps[j] = old[i];
+        }
+
+      free (old);
+    }
+
+  b = glyph_FindBitmap (glyph, hash);
+
+  b->hash = hash;
+  b->width = glyph->width;
+  b->height = glyph->height;
+  b->u = u;
+  b->v = v;
+
+  ++bitmapCount;
+}
+
+int
+GLYPH_Add (unsigned int font, unsigned int code, struct FONT_Glyph *glyph)
+{
+  return GLYPH_AddVariant (font, code, 0, glyph);
+}
+
+int
+GLYPH_AddVariant (unsigned int font, unsigned int code, unsigned int variant,
+                  struct FONT_Glyph *glyph)
+{
+  struct glyph_Data *data;
+  int newTile = 0;
+
+  if (font >= fontCount || code >= 65536 || variant >= variantCount)
+    return GLYPH_OK;
+
+  data = &fonts[font].glyphs[code * variantCount + variant];
+  fonts[font].loadedGlyphs[code >> 5] |= (1 << (code & 31));
 
   if (glyph->width && glyph->height)
     {
+      struct glyph_Bitmap *duplicate;
       unsigned int best_u, best_v, u, k, v_max;
+      unsigned int packWidth, packHeight;
+      uint32_t hash;
 
-      best_u = GLYPH_ATLAS_SIZE;
-      best_v = GLYPH_ATLAS_SIZE;
+      hash = glyph_Hash (glyph);
 
-      for(u = 0; u < GLYPH_ATLAS_SIZE - glyph->width + 1; ++u)
+      if (bitmapCount
+          && (duplicate = glyph_FindBitmap (glyph, hash))->width)
+        {
+          data->u = duplicate->u;
+          data->v = duplicate->v;
+
+          ++duplicateCount;
+          duplicateBytes += glyph->width * glyph->height * sizeof (*bitmap);
+
+          goto packed;
+        }
+
+      /* Keep every column of the skyline a multiple of the alignment */
+      packWidth = (glyph->width + padding + alignment - 1) / alignment * alignment;
+      packHeight = (glyph->height + padding + alignment - 1) / alignment * alignment;
+
+      if (packWidth > atlasSize)
+        return GLYPH_ATLAS_FULL;
+
+      best_u = atlasSize;
+      best_v = atlasSize;
+
+      for(u = 0; u < atlasSize - packWidth + 1; u += alignment)
         {
           v_max = top[u];
 
-          for(k = 1; k < glyph->width && v_max < best_v; ++k)
+          for(k = 1; k < packWidth && v_max < best_v; ++k)
             {
               if (top[u + k] > v_max)
                 v_max = top[u + k];
@@ -79,51 +440,112 @@ GLYPH_Add (unsigned int code, struct FONT_Glyph *glyph)
             }
         }
 
-      if (best_u == GLYPH_ATLAS_SIZE || best_v + glyph->height > GLYPH_ATLAS_SIZE)
-        {
-          errx (EXIT_FAILURE, "Atlas is full: No room for glyph of size %ux%u", glyph->width, glyph->height);
-
-          return;
-        }
+      if (best_u == atlasSize || best_v + packHeight > atlasSize)
+        return GLYPH_ATLAS_FULL;
 
-      glyphs[code].u = best_u;
-      glyphs[code].v = best_v;
+      data->u = best_u;
+      data->v = best_v;
 
       for (k = 0; k < glyph->height; ++k)
         {
-          memcpy (bitmap + (best_v + k)* GLYPH_ATLAS_SIZE + best_u,
+          memcpy (bitmap + (best_v + k)* atlasSize + best_u,
                   glyph->data + (k * glyph->width) * 4,
                   glyph->width * 4);
         }
 
-      for (k = 0; k < glyph->width; ++k)
-        top[best_u + k] = best_v + glyph->height;
+      for (k = 0; k < packWidth; ++k)
+        top[best_u + k] = best_v + packHeight;
+
+      glyph_AddBitmap (glyph, hash, best_u, best_v);
+      newTile = 1;
     }
 
-  glyphs[code].width = glyph->width;
-  glyphs[code].height = glyph->height;
-  glyphs[code].x = glyph->x;
-  glyphs[code].y = glyph->y;
-  glyphs[code].xOffset = glyph->xOffset;
-  glyphs[code].yOffset = glyph->yOffset;
+packed:
+
+  data->width = glyph->width;
+  data->height = glyph->height;
+  data->x = glyph->x;
+  data->y = glyph->y;
+  data->xOffset = glyph->xOffset;
+  data->yOffset = glyph->yOffset;
+  data->xAdvance = glyph->xAdvance;
 
   glyph_dirty = 1;
+
+  /* The record goes first, so readers know the tile's owner when it
+   * arrives.  Duplicates refer to a tile that was already sent.  */
+  if (glyph_stream && glyph->width && glyph->height)
+    {
+      glyph_WriteChunkHeader (glyph_stream, "GLYF", 24);
+      glyph_WriteRecord (glyph_stream, font, code * variantCount + variant);
+
+      if (newTile)
+        glyph_WriteTile (data->u, data->v, glyph->width, glyph->height);
+
+      fflush (glyph_stream);
+    }
+
+  return GLYPH_OK;
+}
+
+int
+GLYPH_Load (unsigned int font, struct FONT_Data *data, unsigned int code)
+{
+  struct FONT_Glyph *glyph;
+  unsigned int variant;
+  int result;
+
+  if (variantCount == 1)
+    {
+      if (!(glyph = FONT_GlyphForCharacter (data, code)))
+        return GLYPH_RENDER_FAILED;
+
+      result = GLYPH_Add (font, code, glyph);
+
+      free (glyph);
+
+      return result;
+    }
+
+  for (variant = 0; variant < variantCount; ++variant)
+    {
+      if (!(glyph = FONT_GlyphForCharacterAt (data, code, variant * 64 / variantCount)))
+        return GLYPH_RENDER_FAILED;
+
+      result = GLYPH_AddVariant (font, code, variant, glyph);
+
+      free (glyph);
+
+      if (result != GLYPH_OK)
+        return result;
+    }
+
+  return GLYPH_OK;
+}
+
+void
+GLYPH_DuplicateStatistics (unsigned int *count, size_t *bytesSaved)
+{
+  *count = duplicateCount;
+  *bytesSaved = duplicateBytes;
 }
 
 int
-GLYPH_IsLoaded (unsigned int code)
+GLYPH_IsLoaded (unsigned int font, unsigned int code)
 {
-  if (code >= sizeof (glyphs) / sizeof (glyphs[0]))
+  if (font >= fontCount || code >= 65536)
     return 1;
 
-  return (loadedGlyphs[code >> 5] & (1 << (code & 31)));
+  return (fonts[font].loadedGlyphs[code >> 5] & (1 << (code & 31)));
 }
 
 void
-GLYPH_Get (unsigned int code, struct FONT_Glyph *glyph,
+GLYPH_Get (unsigned int font, unsigned int code, struct FONT_Glyph *glyph,
            uint16_t *u, uint16_t *v)
 {
-  if (code >= sizeof (glyphs) / sizeof (glyphs[0]))
+  const struct glyph_Data *data;
+
+  if (font >= fontCount || code >= 65536)
     {
       memset (glyph, 0, sizeof (*glyph));
       *u = 0.0f;
@@ -132,15 +554,18 @@ GLYPH_Get (unsigned int code, struct FONT_Glyph *glyph,
       return;
     }
 
-  glyph->width = glyphs[code].width;
-  glyph->height = glyphs[code].height;
-  glyph->x = glyphs[code].x;
-  glyph->y = glyphs[code].y;
-  glyph->xOffset = glyphs[code].xOffset;
-  glyph->yOffset = glyphs[code].yOffset;
+  data = &fonts[font].glyphs[code * variantCount];
+
+  glyph->width = data->width;
+  glyph->height = data->height;
+  glyph->x = data->x;
+  glyph->y = data->y;
+  glyph->xOffset = data->xOffset;
+  glyph->yOffset = data->yOffset;
+  glyph->xAdvance = data->xAdvance;
 
-  *u = glyphs[code].u;
-  *v = glyphs[code].v;
+  *u = data->u;
+  *v = data->v;
 }
 
 static void
@@ -150,56 +575,422 @@ glyph_WriteS16 (FILE *output, int v)
   fputc ((v & 0xff00) >> 8, output);
 }
 
+static void
+glyph_WriteU32 (FILE *output, uint32_t v)
+{
+  glyph_WriteS16 (output, v & 0xffff);
+  glyph_WriteS16 (output, v >> 16);
+}
+
+static void
+glyph_WriteU64 (FILE *output, uint64_t v)
+{
+  glyph_WriteU32 (output, v & 0xffffffff);
+  glyph_WriteU32 (output, v >> 32);
+}
+
+static void
+glyph_WriteFontMetrics (FILE *output)
+{
+  unsigned int font;
+
+  for (font = 0; font < fontCount; ++font)
+    {
+      glyph_WriteS16 (output, fonts[font].ascent);
+      glyph_WriteS16 (output, fonts[font].descent);
+      glyph_WriteS16 (output, fonts[font].lineHeight);
+      glyph_WriteS16 (output, fonts[font].spaceWidth);
+    }
+}
+
+/* Returns non-zero if entry `i' of `font' has a glyph record */
+static int
+glyph_HasRecord (unsigned int font, size_t i)
+{
+  const struct glyph_Data *glyph = &fonts[font].glyphs[i];
+  size_t code = i / variantCount;
+
+  if (!(fonts[font].loadedGlyphs[code >> 5] & (1 << (code & 31))))
+    return 0;
+
+  return glyph->width > 0 && glyph->height > 0;
+}
+
+static void
+glyph_WriteRecord (FILE *output, unsigned int font, size_t i)
+{
+  const struct glyph_Data *glyph = &fonts[font].glyphs[i];
+
+  glyph_WriteS16 (output, font);
+  glyph_WriteS16 (output, i / variantCount);
+  glyph_WriteS16 (output, i % variantCount);
+  glyph_WriteS16 (output, glyph->xOffset);
+  glyph_WriteU32 (output, glyph->xAdvance);
+  glyph_WriteS16 (output, glyph->width);
+  glyph_WriteS16 (output, glyph->height);
+  glyph_WriteS16 (output, glyph->x);
+  glyph_WriteS16 (output, glyph->y);
+  glyph_WriteS16 (output, glyph->u);
+  glyph_WriteS16 (output, glyph->v);
+}
+
+static void
+glyph_WriteRecords (FILE *output)
+{
+  unsigned int font;
+  size_t i;
+
+  for (font = 0; font < fontCount; ++font)
+    {
+      for (i = 0; i < 65536 * variantCount; ++i)
+        {
+          if (glyph_HasRecord (font, i))
+            glyph_WriteRecord (output, font, i);
+        }
+    }
+}
+
+/* Returns the atlas encoded in the selected pixel format */
+static uint8_t *
+glyph_EncodeAtlas (size_t *size)
+{
+  uint8_t *result;
+
+  *size = COMPRESS_Size (pixelFormat, atlasSize, atlasSize);
+
+  if (!(result = malloc (*size)))
+    err (EXIT_FAILURE, "Failed to allocate %zu bytes for encoded atlas", *size);
+
+  COMPRESS_Encode (pixelFormat, (const uint8_t *) bitmap, atlasSize, atlasSize,
+                   result, &compressionError);
+
+  return result;
+}
+
+/* KTX2 identifiers for each pixel format.  Every channel holds coverage,
+ * which is linear, so no format is sRGB.  */
+static const struct
+{
+  uint32_t vkFormat;
+  uint8_t colorModel, transferFunction;
+  uint8_t blockSize; /* texel block width and height */
+  uint8_t blockBytes;
+}
+glyph_ktx2Formats[] =
+{
+  {  37,   1, 1, 1,  4 }, /* VK_FORMAT_R8G8B8A8_UNORM */
+  { 139, 131, 1, 4,  8 }, /* VK_FORMAT_BC4_UNORM_BLOCK */
+  { 145, 134, 1, 4, 16 }, /* VK_FORMAT_BC7_UNORM_BLOCK */
+  { 151, 161, 1, 4, 16 }  /* VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK */
+};
+
+/* Writes the samples of the KTX2 data format descriptor, or returns their
+ * count if `output' is NULL.  */
+static unsigned int
+glyph_WriteKTX2Samples (FILE *output)
+{
+  /* Bit offset, bit length minus one, channel and qualifiers, upper bound */
+  static const uint32_t rgba[][4] =
+    {
+      {  0,  7,  0,   255 },
+      {  8,  7,  1,   255 },
+      { 16,  7,  2,   255 },
+      { 24,  7, 0x0f, 255 }  /* alpha */
+    };
+  static const uint32_t bc4[][4] = { { 0, 63, 0, 0xffffffff } };
+  static const uint32_t bc7[][4] = { { 0, 127, 0, 0xffffffff } };
+  static const uint32_t etc2[][4] =
+    {
+      {  0, 63, 0x0f, 0xffffffff }, /* alpha */
+      { 64, 63,    2, 0xffffffff }  /* color */
+    };
+
+  const uint32_t (*samples)[4];
+  unsigned int i, count;
+
+  switch (pixelFormat)
+    {
+    case COMPRESS_BC4:  samples = bc4;  count = 1; break;
+    case COMPRESS_BC7:  samples = bc7;  count = 1; break;
+    case COMPRESS_ETC2: samples = etc2; count = 2; break;
+    default:            samples = rgba; count = 4; break;
+    }
+
+  if (!output)
+    return count;
+
+  for (i = 0; i < count; ++i)
+    {
+      glyph_WriteU32 (output, samples[i][0] | samples[i][1] << 16 | samples[i][2] << 24);
+      glyph_WriteU32 (output, 0); /* sample position */
+      glyph_WriteU32 (output, 0); /* lower bound */
+      glyph_WriteU32 (output, samples[i][3]);
+    }
+
+  return count;
+}
+
+static void
+glyph_WriteKTX2KeyValue (FILE *output, const char *key, const void *value,
+                         size_t valueSize)
+{
+  size_t length = strlen (key) + 1 + valueSize;
+
+  glyph_WriteU32 (output, length);
+  fwrite (key, 1, strlen (key) + 1, output);
+  fwrite (value, 1, valueSize, output);
+
+  for (; length & 3; ++length)
+    fputc (0, output);
+}
+
+/* Writes the atlas and its mip chain as a KTX2 texture.  The glyph table
+ * is stored under the `bmfont.glyphs' key, in the layout of the binary
+ * format without the atlas.  */
+static void
+glyph_ExportKTX2 (FILE *output)
+{
+  static const uint8_t identifier[12] =
+    {
+      0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n'
+    };
+  static const char writer[] = PACKAGE_STRING;
+  static const char glyphsKey[] = "bmfont.glyphs";
+
+  uint8_t *levels[16], *encoded[16];
+  size_t encodedSize[16], offsets[16], offset, glyphsSize, recordCount = 0, i;
+  uint32_t dfdOffset, dfdSize, kvdOffset, kvdSize, levelAlignment;
+  unsigned int level, font, sampleCount, size;
+
+  /* Generate and encode every level, keeping the error of the first */
+  levels[0] = (uint8_t *) bitmap;
+
+  for (level = 0; level < mipLevels; ++level)
+    {
+      struct COMPRESS_Error error;
+
+      size = atlasSize >> level;
+
+      if (level)
+        {
+          if (!(levels[level] = malloc ((size_t) size * size * 4)))
+            err (EXIT_FAILURE, "Failed to allocate %ux%u mip level", size, size);
+
+          MIPMAP_Downsample (mipFilter, levels[level - 1],
+                             atlasSize >> (level - 1), atlasSize >> (level - 1),
+                             levels[level]);
+        }
+
+      encodedSize[level] = COMPRESS_Size (pixelFormat, size, size);
+
+      if (!(encoded[level] = malloc (encodedSize[level])))
+        err (EXIT_FAILURE, "Failed to allocate %zu bytes for mip level %u", encodedSize[level], level);
+
+      COMPRESS_Encode (pixelFormat, levels[level], size, size, encoded[level],
+                       level ? &error : &compressionError);
+    }
+
+  for (font = 0; font < fontCount; ++font)
+    {
+      for (i = 0; i < 65536 * variantCount; ++i)
+        recordCount += glyph_HasRecord (font, i);
+    }
+
+  glyphsSize = 2 * (2 + 4 * fontCount + 12 * recordCount);
+  sampleCount = glyph_WriteKTX2Samples (NULL);
+
+  dfdOffset = 80 + 24 * mipLevels;
+  dfdSize = 4 + 24 + 16 * sampleCount;
+  kvdOffset = dfdOffset + dfdSize;
+  kvdSize = ((4 + sizeof ("KTXwriter") + sizeof (writer) + 3) & ~3)
+          + ((4 + sizeof (glyphsKey) + glyphsSize + 3) & ~3);
+
+  /* Levels are stored smallest first, each aligned to a whole block */
+  levelAlignment = glyph_ktx2Formats[pixelFormat].blockBytes;
+
+  if (levelAlignment < 4)
+    levelAlignment = 4;
+
+  offset = kvdOffset + kvdSize;
+
+  for (level = mipLevels; level-- > 0; )
+    {
+      offset = (offset + levelAlignment - 1) / levelAlignment * levelAlignment;
+      offsets[level] = offset;
+      offset += encodedSize[level];
+    }
+
+  fwrite (identifier, 1, sizeof (identifier), output);
+  glyph_WriteU32 (output, glyph_ktx2Formats[pixelFormat].vkFormat);
+  glyph_WriteU32 (output, 1); /* type size */
+  glyph_WriteU32 (output, atlasSize);
+  glyph_WriteU32 (output, atlasSize);
+  glyph_WriteU32 (output, 0); /* depth */
+  glyph_WriteU32 (output, 0); /* layer count */
+  glyph_WriteU32 (output, 1); /* face count */
+  glyph_WriteU32 (output, mipLevels);
+  glyph_WriteU32 (output, 0); /* no supercompression */
+
+  glyph_WriteU32 (output, dfdOffset);
+  glyph_WriteU32 (output, dfdSize);
+  glyph_WriteU32 (output, kvdOffset);
+  glyph_WriteU32 (output, kvdSize);
+  glyph_WriteU64 (output, 0);
+  glyph_WriteU64 (output, 0);
+
+  for (level = 0; level < mipLevels; ++level)
+    {
+      glyph_WriteU64 (output, offsets[level]);
+      glyph_WriteU64 (output, encodedSize[level]);
+      glyph_WriteU64 (output, encodedSize[level]);
+    }
+
+  /* Basic data format descriptor */
+  glyph_WriteU32 (output, dfdSize);
+  glyph_WriteU32 (output, 0);
+  glyph_WriteU32 (output, 2 | (24 + 16 * sampleCount) << 16);
+  glyph_WriteU32 (output, glyph_ktx2Formats[pixelFormat].colorModel
+                          | 1 << 8 /* BT.709 primaries */
+                          | glyph_ktx2Formats[pixelFormat].transferFunction << 16);
+  glyph_WriteU32 (output, (glyph_ktx2Formats[pixelFormat].blockSize - 1)
+                          | (glyph_ktx2Formats[pixelFormat].blockSize - 1) << 8);
+  glyph_WriteU32 (output, glyph_ktx2Formats[pixelFormat].blockBytes);
+  glyph_WriteU32 (output, 0);
+  glyph_WriteKTX2Samples (output);
+
+  /* Keys are sorted by their bytes, so `KTXwriter' comes first */
+  glyph_WriteKTX2KeyValue (output, "KTXwriter", writer, sizeof (writer));
+
+  glyph_WriteU32 (output, sizeof (glyphsKey) + glyphsSize);
+  fwrite (glyphsKey, 1, sizeof (glyphsKey), output);
+  glyph_WriteS16 (output, fontCount);
+  glyph_WriteS16 (output, variantCount);
+  glyph_WriteFontMetrics (output);
+  glyph_WriteRecords (output);
+
+  for (i = sizeof (glyphsKey) + glyphsSize; i & 3; ++i)
+    fputc (0, output);
+
+  offset = kvdOffset + kvdSize;
+
+  for (level = mipLevels; level-- > 0; )
+    {
+      for (; offset < offsets[level]; ++offset)
+        fputc (0, output);
+
+      fwrite (encoded[level], 1, encodedSize[level], output);
+      offset += encodedSize[level];
+
+      free (encoded[level]);
+
+      if (level)
+        free (levels[level]);
+    }
+}
+
 void
 GLYPH_Export (const char* format, FILE *output)
 {
   size_t i;
+  unsigned int font;
 
   if (!strcmp(format, "binary"))
     {
-      glyph_WriteS16 (output, GLYPH_ATLAS_SIZE);
+      uint8_t *encoded;
+      size_t encodedSize;
 
-      fwrite (bitmap, sizeof (*bitmap), GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE, output);
+      glyph_WriteS16 (output, atlasSize);
+      glyph_WriteS16 (output, fontCount);
+      glyph_WriteS16 (output, variantCount);
+      glyph_WriteS16 (output, pixelFormat);
 
-      for (i = 0; i < sizeof (glyphs) / sizeof (glyphs[0]); ++i)
-        {
-          if (!(loadedGlyphs[i >> 5] & (1 << (i & 31))))
-            continue;
+      glyph_WriteFontMetrics (output);
 
-          if (glyphs[i].width <= 0 || glyphs[i].height <= 0)
-            continue;
+      encoded = glyph_EncodeAtlas (&encodedSize);
+      fwrite (encoded, 1, encodedSize, output);
+      free (encoded);
 
-          glyph_WriteS16 (output, i);
-          glyph_WriteS16 (output, glyphs[i].xOffset);
-          glyph_WriteS16 (output, glyphs[i].width);
-          glyph_WriteS16 (output, glyphs[i].height);
-          glyph_WriteS16 (output, glyphs[i].x);
-          glyph_WriteS16 (output, glyphs[i].y);
-          glyph_WriteS16 (output, glyphs[i].u);
-          glyph_WriteS16 (output, glyphs[i].v);
-        }
+      glyph_WriteRecords (output);
+    }
+  else if (!strcmp(format, "ktx2"))
+    {
+      glyph_ExportKTX2 (output);
+    }
+  else if (!strcmp(format, "stream"))
+    {
+      /* Everything else was written while packing */
+      if (!glyph_stream)
+        errx (EXIT_FAILURE, "The stream format requires GLYPH_SetStream");
+
+      glyph_WriteChunkHeader (glyph_stream, "END ", 0);
+      fflush (glyph_stream);
     }
   else if (!strcmp(format, "c"))
     {
-      fprintf (output, "struct Glyph glyphs[256] = {\n");
+      fprintf (output, "struct FontMetrics fonts[%u] = {\n", fontCount);
 
-      for (i = 0; i < 256; ++i)
+      for (font = 0; font < fontCount; ++font)
         {
-          if (!(loadedGlyphs[i >> 5] & (1 << (i & 31)))
-              || glyphs[i].width <= 0 || glyphs[i].height <= 0)
+          fprintf (output, "  { %d, %d, %d, %d },\n",
+                   fonts[font].ascent, fonts[font].descent,
+                   fonts[font].lineHeight, fonts[font].spaceWidth);
+        }
+
+      fprintf (output, "};\n\n");
+      fprintf (output, "struct Glyph glyphs[%u][256] = {\n", fontCount);
+
+      for (font = 0; font < fontCount; ++font)
+        {
+          fprintf (output, " {\n");
+
+          for (i = 0; i < 256; ++i)
             {
-              fprintf (output, "  { 0, 0, 0, 0, 0, 0, 0 },\n");
-              continue;
+              /* Only the variant at integer pen positions */
+              const struct glyph_Data *glyph = &fonts[font].glyphs[i * variantCount];
+
+              if (!(fonts[font].loadedGlyphs[i >> 5] & (1 << (i & 31)))
+                  || glyph->width <= 0 || glyph->height <= 0)
+                {
+                  fprintf (output, "  { 0, 0, 0, 0, 0, 0, 0 },\n");
+                  continue;
+                }
+
+              fprintf (output, "  { %d, %d, %d, %d, %d, %d, %d },\n",
+                       glyph->xOffset, glyph->width, glyph->height,
+                       glyph->x, glyph->y, glyph->u, glyph->v);
             }
 
-          fprintf (output, "  { %d, %d, %d, %d, %d, %d, %d },\n",
-                   glyphs[i].xOffset, glyphs[i].width, glyphs[i].height,
-                   glyphs[i].x, glyphs[i].y, glyphs[i].u, glyphs[i].v);
+          fprintf (output, " },\n");
         }
       fprintf (output, "};\n\n");
+
+      if (pixelFormat != COMPRESS_RGBA)
+        {
+          uint8_t *encoded;
+          size_t encodedSize;
+
+          encoded = glyph_EncodeAtlas (&encodedSize);
+
+          fprintf (output, "/* %ux%u atlas in %s blocks */\n", atlasSize, atlasSize,
+                   COMPRESS_FormatName (pixelFormat));
+          fprintf (output, "const unsigned char bitmap[] = {");
+
+          for (i = 0; i < encodedSize; ++i)
+            {
+              if (!(i % 16))
+                fprintf (output, "\n ");
+              fprintf (output, " 0x%02x,", encoded[i]);
+            }
+
+          fprintf (output, "\n};\n");
+          free (encoded);
+
+          return;
+        }
+
       fprintf (output, "const unsigned char bitmap[] = {");
 
-      for (i = 0; i < GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE; ++i)
+      for (i = 0; i < atlasSize * atlasSize; ++i)
         {
           if (!(i % 4))
             fprintf (output, "\n ");
@@ -215,3 +1006,9 @@ GLYPH_Export (const char* format, FILE *output)
       errx(EXIT_FAILURE, "Unknown output format '%s'", format);
     }
 }
+
+void
+GLYPH_CompressionError (struct COMPRESS_Error *error)
+{
+  *error = compressionError;
+}
@@ -1,24 +1,104 @@
 #ifndef GLYPH_H_
 #define GLYPH_H_ 1
 
+#include <stddef.h>
+#include <stdio.h>
+
+#include "compress.h"
 #include "font.h"
+#include "mipmap.h"
 
+/* Default width and height of the atlas */
 #define GLYPH_ATLAS_SIZE 128
 
+#define GLYPH_MAX_FONTS 256
+
+/* Results of adding glyphs */
+#define GLYPH_OK             0
+#define GLYPH_RENDER_FAILED -1
+#define GLYPH_ATLAS_FULL    -2
+
+void
+GLYPH_Init (unsigned int atlasSize);
+
+/* Discards the atlas and all fonts, so that GLYPH_Init can start a new one.
+ * The subpixel, pixel format and mip settings are kept.  */
+void
+GLYPH_Reset (void);
+
+/* Sets the number of fractional x offsets each glyph is rendered at.  Must
+ * be called before the first GLYPH_AddFont.
+
+   With one position, glyphs are fully hinted and advances are whole
+   pixels.  With more, every variant, including the one at offset 0, is
+   hinted vertically only, and advances and the space width are unhinted,
+   so that the pen can keep its fraction.  */
+void
+GLYPH_SetSubpixelPositions (unsigned int count);
+
+/* Sets the pixel format of the exported atlas.  Block compressed formats
+ * align glyphs to 4x4 blocks, so must be set before adding fonts.  */
+void
+GLYPH_SetPixelFormat (enum COMPRESS_Format format);
+
+/* Sets the number of mip levels written by the ktx2 export format.  Glyphs
+ * are spaced so they do not bleed into each other at the smallest level,
+ * so this must be set before adding fonts.  */
+void
+GLYPH_SetMipLevels (unsigned int levels, enum MIPMAP_Filter filter);
+
+/* Writes the atlas to `output' while it is being built, for the "stream"
+ * export format.  Must be called before adding fonts.  The stream is
+ * flushed after each glyph, so readers see it as soon as it is packed.
+
+   The stream starts with "BMFS", followed by chunks of a U32 payload
+   length, a four character type and the payload.  Numbers are 16-bit
+   little endian unless noted.
+
+     HEAD  atlas size, variant count, pixel format
+     FONT  font index, ascent, descent, line height, space width
+     GLYF  one record as in the binary format
+     TILE  u, v, width and height, then the pixels of that rectangle in
+           the pixel format.  Follows the GLYF of the glyph it holds;
+           glyphs with a duplicate bitmap get no tile of their own.
+     END   no payload; written by GLYPH_Export
+
+   Readers should skip chunks of unknown types.  */
 void
-GLYPH_Init (void);
+GLYPH_SetStream (FILE *output);
+
+/* Registers a font sharing the atlas and returns its index */
+unsigned int
+GLYPH_AddFont (struct FONT_Data *data);
+
+int
+GLYPH_Add (unsigned int font, unsigned int code, struct FONT_Glyph *glyph);
 
+/* Adds the glyph rendered at subpixel position `variant' */
+int
+GLYPH_AddVariant (unsigned int font, unsigned int code, unsigned int variant,
+                  struct FONT_Glyph *glyph);
+
+/* Renders `code' from `data' at every subpixel position and adds it */
+int
+GLYPH_Load (unsigned int font, struct FONT_Data *data, unsigned int code);
+
+/* Reports glyphs that reused an identical bitmap already in the atlas */
 void
-GLYPH_Add (unsigned int code, struct FONT_Glyph *glyph);
+GLYPH_DuplicateStatistics (unsigned int *count, size_t *bytesSaved);
 
 int
-GLYPH_IsLoaded (unsigned int code);
+GLYPH_IsLoaded (unsigned int font, unsigned int code);
 
 void
-GLYPH_Get (unsigned int code, struct FONT_Glyph *glyph,
+GLYPH_Get (unsigned int font, unsigned int code, struct FONT_Glyph *glyph,
            uint16_t *u, uint16_t *v);
 
 void
 GLYPH_Export (const char* format, FILE *output);
 
+/* Reports the encoding error of the last exported atlas */
+void
+GLYPH_CompressionError (struct COMPRESS_Error *error);
+
 #endif /* GLYPH_H_ */
@@ -0,0 +1,311 @@
+/*
+  Mipmap generation
+  Copyright (C) 2012  Morten Hustveit <morten.hustveit@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "mipmap.h"
+
+/* Number of source texels the Kaiser filter reads for each output texel */
+#define MIPMAP_KAISER_TAPS 8
+
+#define MIPMAP_PI 3.14159265358979323846
+
+/* RGBA coverage, one float per channel */
+#ifdef __SSE__
+typedef __m128 mipmap_Pixel;
+#else
+typedef struct
+{
+  float v[4];
+} mipmap_Pixel;
+#endif
+
+static const char *mipmap_filterNames[] = { "box", "kaiser" };
+
+static float mipmap_kaiserWeights[MIPMAP_KAISER_TAPS];
+
+static int mipmap_initialized;
+
+int
+MIPMAP_FilterForName (const char *name)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof (mipmap_filterNames) / sizeof (mipmap_filterNames[0]); ++i)
+    {
+      if (!strcmp (name, mipmap_filterNames[i]))
+        return i;
+    }
+
+  return -1;
+}
+
+unsigned int
+MIPMAP_Footprint (enum MIPMAP_Filter filter)
+{
+  /* Bilinear sampling reads one texel past the glyph.  The Kaiser filter's
+   * lobes reach two texels further at every level.  */
+  return (filter == MIPMAP_KAISER) ? 3 : 1;
+}
+
+/* Zeroth order modified Bessel function of the first kind */
+static double
+mipmap_BesselI0 (double x)
+{
+  double sum = 1.0, term = 1.0;
+  unsigned int k;
+
+  for (k = 1; k < 32; ++k)
+    {
+      term *= (x / (2 * k)) * (x / (2 * k));
+      sum += term;
+    }
+
+  return sum;
+}
+
+static void
+mipmap_Init (void)
+{
+  const double beta = 4.0, radius = MIPMAP_KAISER_TAPS / 2;
+  double sum = 0.0;
+  unsigned int i;
+
+  /* Windowed sinc with a cutoff at the new Nyquist frequency.  Output
+   * texel centers fall halfway between two source texel centers.  */
+  for (i = 0; i < MIPMAP_KAISER_TAPS; ++i)
+    {
+      double d = i - radius + 0.5, x = d / 2.0, sinc, window;
+
+      sinc = sin (MIPMAP_PI * x) / (MIPMAP_PI * x);
+      window = mipmap_BesselI0 (beta * sqrt (1.0 - (d / radius) * (d / radius)))
+             / mipmap_BesselI0 (beta);
+
+      mipmap_kaiserWeights[i] = sinc * window;
+      sum += mipmap_kaiserWeights[i];
+    }
+
+  for (i = 0; i < MIPMAP_KAISER_TAPS; ++i)
+    mipmap_kaiserWeights[i] /= sum;
+
+  mipmap_initialized = 1;
+}
+
+static uint8_t
+mipmap_ToByte (float value)
+{
+  return (value <= 0.0f) ? 0 : (value >= 1.0f) ? 255 : (uint8_t) (value * 255.0f + 0.5f);
+}
+
+#ifdef __SSE__
+
+static inline mipmap_Pixel
+mipmap_Load (const uint8_t *rgba)
+{
+  return _mm_mul_ps (_mm_set_ps (rgba[3], rgba[2], rgba[1], rgba[0]),
+                     _mm_set1_ps (1.0f / 255.0f));
+}
+
+static inline mipmap_Pixel
+mipmap_Zero (void)
+{
+  return _mm_setzero_ps ();
+}
+
+static inline mipmap_Pixel
+mipmap_MulAdd (mipmap_Pixel sum, mipmap_Pixel value, float weight)
+{
+  return _mm_add_ps (sum, _mm_mul_ps (value, _mm_set1_ps (weight)));
+}
+
+static inline void
+mipmap_Store (uint8_t *rgba, mipmap_Pixel value)
+{
+  float v[4];
+
+  _mm_storeu_ps (v, value);
+
+  rgba[0] = mipmap_ToByte (v[0]);
+  rgba[1] = mipmap_ToByte (v[1]);
+  rgba[2] = mipmap_ToByte (v[2]);
+  rgba[3] = mipmap_ToByte (v[3]);
+}
+
+#else
+
+static inline mipmap_Pixel
+mipmap_Load (const uint8_t *rgba)
+{
+  mipmap_Pixel result;
+
+  result.v[0] = rgba[0] / 255.0f;
+  result.v[1] = rgba[1] / 255.0f;
+  result.v[2] = rgba[2] / 255.0f;
+  result.v[3] = rgba[3] / 255.0f;
+
+  return result;
+}
+
+static inline mipmap_Pixel
+mipmap_Zero (void)
+{
+  mipmap_Pixel result;
+
+  memset (&result, 0, sizeof (result));
+
+  return result;
+}
+
+static inline mipmap_Pixel
+mipmap_MulAdd (mipmap_Pixel sum, mipmap_Pixel value, float weight)
+{
+  unsigned int c;
+
+  for (c = 0; c < 4; ++c)
+    sum.v[c] += value.v[c] * weight;
+
+  return sum;
+}
+
+static inline void
+mipmap_Store (uint8_t *rgba, mipmap_Pixel value)
+{
+  rgba[0] = mipmap_ToByte (value.v[0]);
+  rgba[1] = mipmap_ToByte (value.v[1]);
+  rgba[2] = mipmap_ToByte (value.v[2]);
+  rgba[3] = mipmap_ToByte (value.v[3]);
+}
+
+#endif
+
+static unsigned int
+mipmap_Clamp (int value, unsigned int size)
+{
+  return (value < 0) ? 0 : ((unsigned int) value >= size) ? size - 1 : (unsigned int) value;
+}
+
+static void
+mipmap_DownsampleBox (const uint8_t *input, unsigned int width,
+                      unsigned int height, uint8_t *output,
+                      unsigned int outputWidth, unsigned int outputHeight)
+{
+  unsigned int x, y;
+
+  for (y = 0; y < outputHeight; ++y)
+    {
+      const uint8_t *row0, *row1;
+
+      row0 = input + (size_t) mipmap_Clamp (2 * y, height) * width * 4;
+      row1 = input + (size_t) mipmap_Clamp (2 * y + 1, height) * width * 4;
+
+      for (x = 0; x < outputWidth; ++x)
+        {
+          unsigned int x0 = mipmap_Clamp (2 * x, width) * 4;
+          unsigned int x1 = mipmap_Clamp (2 * x + 1, width) * 4;
+          mipmap_Pixel sum = mipmap_Zero ();
+
+          sum = mipmap_MulAdd (sum, mipmap_Load (row0 + x0), 0.25f);
+          sum = mipmap_MulAdd (sum, mipmap_Load (row0 + x1), 0.25f);
+          sum = mipmap_MulAdd (sum, mipmap_Load (row1 + x0), 0.25f);
+          sum = mipmap_MulAdd (sum, mipmap_Load (row1 + x1), 0.25f);
+
+          mipmap_Store (output + ((size_t) y * outputWidth + x) * 4, sum);
+        }
+    }
+}
+
+static void
+mipmap_DownsampleKaiser (const uint8_t *input, unsigned int width,
+                         unsigned int height, uint8_t *output,
+                         unsigned int outputWidth, unsigned int outputHeight)
+{
+  mipmap_Pixel *columns;
+  unsigned int x, y, k;
+
+  /* Filter horizontally into `columns', which is outputWidth by height */
+  if (!(columns = malloc ((size_t) outputWidth * height * sizeof (*columns))))
+    err (EXIT_FAILURE, "Failed to allocate %ux%u filter buffer", outputWidth, height);
+
+  for (y = 0; y < height; ++y)
+    {
+      const uint8_t *row = input + (size_t) y * width * 4;
+
+      for (x = 0; x < outputWidth; ++x)
+        {
+          mipmap_Pixel sum = mipmap_Zero ();
+          int first = 2 * (int) x - MIPMAP_KAISER_TAPS / 2 + 1;
+
+          for (k = 0; k < MIPMAP_KAISER_TAPS; ++k)
+            {
+              sum = mipmap_MulAdd (sum, mipmap_Load (row + mipmap_Clamp (first + k, width) * 4),
+                                   mipmap_kaiserWeights[k]);
+            }
+
+          columns[(size_t) y * outputWidth + x] = sum;
+        }
+    }
+
+  for (y = 0; y < outputHeight; ++y)
+    {
+      int first = 2 * (int) y - MIPMAP_KAISER_TAPS / 2 + 1;
+
+      for (x = 0; x < outputWidth; ++x)
+        {
+          mipmap_Pixel sum = mipmap_Zero ();
+
+          for (k = 0; k < MIPMAP_KAISER_TAPS; ++k)
+            {
+              sum = mipmap_MulAdd (sum, columns[(size_t) mipmap_Clamp (first + k, height) * outputWidth + x],
+                                   mipmap_kaiserWeights[k]);
+            }
+
+          mipmap_Store (output + ((size_t) y * outputWidth + x) * 4, sum);
+        }
+    }
+
+  free (columns);
+}
+
+void
+MIPMAP_Downsample (enum MIPMAP_Filter filter, const uint8_t *input,
+                   unsigned int width, unsigned int height, uint8_t *output)
+{
+  unsigned int outputWidth, outputHeight;
+
+  if (!mipmap_initialized)
+    mipmap_Init ();
+
+  outputWidth = (width > 1) ? width / 2 : 1;
+  outputHeight = (height > 1) ? height / 2 : 1;
+
+  if (filter == MIPMAP_KAISER)
+    mipmap_DownsampleKaiser (input, width, height, output, outputWidth, outputHeight);
+  else
+    mipmap_DownsampleBox (input, width, height, output, outputWidth, outputHeight);
+}
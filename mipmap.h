@@ -0,0 +1,28 @@
+#ifndef MIPMAP_H_
+#define MIPMAP_H_ 1
+
+#include <stdint.h>
+
+enum MIPMAP_Filter
+{
+  MIPMAP_BOX = 0,
+  MIPMAP_KAISER = 1
+};
+
+/* Returns the filter called `name', or -1 if there is none */
+int
+MIPMAP_FilterForName (const char *name);
+
+/* Returns how many texels around each glyph, at the lowest of `levels' mip
+ * levels, may receive color from it when sampling with `filter'.  */
+unsigned int
+MIPMAP_Footprint (enum MIPMAP_Filter filter);
+
+/* Halves an RGBA image in each direction.  Every channel holds linear
+ * coverage, so all four are filtered alike.  The result is
+ * max(width / 2, 1) by max(height / 2, 1) pixels.  */
+void
+MIPMAP_Downsample (enum MIPMAP_Filter filter, const uint8_t *input,
+                   unsigned int width, unsigned int height, uint8_t *output);
+
+#endif /* !MIPMAP_H_ */
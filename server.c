@@ -0,0 +1,838 @@
+/*
+  Glyph server
+  Copyright (C) 2012  Morten Hustveit <morten.hustveit@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#define _POSIX_C_SOURCE 200809L
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "font.h"
+#include "glyph.h"
+#include "server.h"
+
+/* Requests are small; anything larger is a protocol error */
+#define SERVER_MAX_REQUEST 65536
+
+/* Clients with this much unsent output are not read from until it drains */
+#define SERVER_MAX_BACKLOG (16 * 1024 * 1024)
+
+#define SERVER_MAX_CLIENTS 64
+
+struct server_Buffer
+{
+  uint8_t *data;
+  size_t size, alloc;
+};
+
+struct server_Client
+{
+  int fd;
+
+  struct server_Buffer input;
+  struct server_Buffer output;
+  size_t outputOffset; /* bytes of `output' already sent */
+};
+
+/* A loaded font, kept for later requests */
+struct server_Font
+{
+  char *name;
+  unsigned int size, weight;
+
+  struct FONT_Data *font;
+  unsigned long lastUse;
+};
+
+/* Reads fields from a request payload */
+struct server_Reader
+{
+  const uint8_t *data;
+  size_t size, offset;
+  int overflow;
+};
+
+static const struct SERVER_Options *server_options;
+
+static struct server_Font *server_fonts;
+static unsigned long server_useCount;
+
+/* Fonts used and loaded by the current request */
+static unsigned int server_fontsUsed, server_fontsLoaded;
+
+static char server_error[256];
+
+static int
+server_Fail (const char *format, ...)
+{
+  va_list args;
+
+  va_start (args, format);
+  vsnprintf (server_error, sizeof (server_error), format, args);
+  va_end (args);
+
+  return -1;
+}
+
+static void
+server_Append (struct server_Buffer *buffer, const void *data, size_t size)
+{
+  if (buffer->size + size > buffer->alloc)
+    {
+      buffer->alloc = buffer->alloc ? buffer->alloc * 2 : 4096;
+
+      while (buffer->size + size > buffer->alloc)
+        buffer->alloc *= 2;
+
+      if (!(buffer->data = realloc (buffer->data, buffer->alloc)))
+        err (EXIT_FAILURE, "Failed to allocate %zu byte buffer", buffer->alloc);
+    }
+
+  memcpy (buffer->data + buffer->size, data, size);
+  buffer->size += size;
+}
+
+static void
+server_PutU16 (struct server_Buffer *buffer, unsigned int v)
+{
+  uint8_t bytes[2];
+
+  bytes[0] = v;
+  bytes[1] = v >> 8;
+
+  server_Append (buffer, bytes, 2);
+}
+
+static void
+server_PutU32 (struct server_Buffer *buffer, uint32_t v)
+{
+  server_PutU16 (buffer, v & 0xffff);
+  server_PutU16 (buffer, v >> 16);
+}
+
+/* Replaces the length placeholder of the message starting at `start' */
+static void
+server_FinishMessage (struct server_Buffer *buffer, size_t start)
+{
+  uint32_t length = buffer->size - start - 4;
+
+  buffer->data[start] = length;
+  buffer->data[start + 1] = length >> 8;
+  buffer->data[start + 2] = length >> 16;
+  buffer->data[start + 3] = length >> 24;
+}
+
+static uint32_t
+server_GetU32Bytes (const uint8_t *data)
+{
+  return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+static unsigned int
+server_GetU16 (struct server_Reader *reader)
+{
+  unsigned int result;
+
+  if (reader->offset + 2 > reader->size)
+    {
+      reader->overflow = 1;
+
+      return 0;
+    }
+
+  result = reader->data[reader->offset] | reader->data[reader->offset + 1] << 8;
+  reader->offset += 2;
+
+  return result;
+}
+
+static uint32_t
+server_GetU32 (struct server_Reader *reader)
+{
+  uint32_t result;
+
+  result = server_GetU16 (reader);
+  result |= (uint32_t) server_GetU16 (reader) << 16;
+
+  return result;
+}
+
+/* Reads a font description.  `name' must hold at least 256 bytes.
+ * Returns -1 if it is truncated or invalid.  */
+static int
+server_GetFont (struct server_Reader *reader, struct SERVER_Font *font,
+                char *name)
+{
+  unsigned int length;
+
+  font->size = server_GetU16 (reader);
+  font->weight = server_GetU16 (reader);
+  length = server_GetU16 (reader);
+
+  if (reader->overflow || length > 255 || reader->offset + length > reader->size)
+    {
+      reader->overflow = 1;
+
+      return server_Fail ("Truncated font description");
+    }
+
+  memcpy (name, reader->data + reader->offset, length);
+  name[length] = 0;
+  reader->offset += length;
+
+  font->name = name;
+
+  if (!font->size)
+    return server_Fail ("Invalid size 0 for `%s'.  Expected positive integer", name);
+
+  if (!font->weight)
+    return server_Fail ("Invalid weight 0 for `%s'.  Expected positive integer", name);
+
+  return 0;
+}
+
+static void
+server_PutFont (struct server_Buffer *buffer, const struct SERVER_Font *font)
+{
+  size_t length = strlen (font->name);
+
+  if (length > 255)
+    errx (EXIT_FAILURE, "Font name `%s' is too long", font->name);
+
+  server_PutU16 (buffer, font->size);
+  server_PutU16 (buffer, font->weight);
+  server_PutU16 (buffer, length);
+  server_Append (buffer, font->name, length);
+}
+
+/* Returns the font, loading it if it is not among the most recently used */
+static struct FONT_Data *
+server_LoadFont (const struct SERVER_Font *request)
+{
+  struct server_Font *font, *oldest;
+  unsigned int i;
+
+  ++server_fontsUsed;
+
+  for (i = 0, oldest = server_fonts; i < server_options->maxFonts; ++i)
+    {
+      font = &server_fonts[i];
+
+      if (font->font && font->size == request->size
+          && font->weight == request->weight && !strcmp (font->name, request->name))
+        {
+          font->lastUse = ++server_useCount;
+
+          return font->font;
+        }
+
+      if (font->lastUse < oldest->lastUse)
+        oldest = font;
+    }
+
+  if (oldest->font)
+    {
+      FONT_Free (oldest->font);
+      free (oldest->name);
+    }
+
+  memset (oldest, 0, sizeof (*oldest));
+
+  if (!(oldest->font = FONT_Load (request->name, request->size, request->weight)))
+    return NULL;
+
+  if (!(oldest->name = strdup (request->name)))
+    err (EXIT_FAILURE, "Failed to allocate font name");
+
+  oldest->size = request->size;
+  oldest->weight = request->weight;
+  oldest->lastUse = ++server_useCount;
+
+  ++server_fontsLoaded;
+
+  return oldest->font;
+}
+
+static int
+server_BuildAtlas (struct server_Reader *reader, struct server_Buffer *output)
+{
+  const struct SERVER_Options *options = server_options;
+  unsigned int atlasSize, fontCount, i;
+  char *data = NULL;
+  size_t j, size = 0;
+  FILE *stream;
+  int result = 0;
+
+  atlasSize = server_GetU16 (reader);
+  fontCount = server_GetU16 (reader);
+
+  if (!atlasSize)
+    atlasSize = options->atlasSize;
+
+  /* Larger atlases could exhaust the server's memory */
+  if (atlasSize > options->atlasSize)
+    return server_Fail ("Atlas size %u exceeds the server's limit of %u",
+                        atlasSize, options->atlasSize);
+
+  if (options->pixelFormat != COMPRESS_RGBA && (atlasSize % COMPRESS_BLOCK_SIZE))
+    return server_Fail ("Atlas size %u is not a multiple of the %u pixel block size",
+                        atlasSize, COMPRESS_BLOCK_SIZE);
+
+  if ((atlasSize >> (options->mipLevels - 1)) < 1)
+    return server_Fail ("A %ux%u atlas cannot have %u mip levels",
+                        atlasSize, atlasSize, options->mipLevels);
+
+  if (!fontCount || fontCount > GLYPH_MAX_FONTS)
+    return server_Fail ("Invalid font count %u", fontCount);
+
+  if (!(stream = open_memstream (&data, &size)))
+    err (EXIT_FAILURE, "Failed to open memory stream");
+
+  GLYPH_Reset ();
+  GLYPH_Init (atlasSize);
+  GLYPH_SetSubpixelPositions (options->subpixelPositions);
+  GLYPH_SetPixelFormat (options->pixelFormat);
+  GLYPH_SetMipLevels (options->mipLevels, options->mipFilter);
+
+  if (!strcmp (options->format, "stream"))
+    GLYPH_SetStream (stream);
+
+  /* Each font is complete before the next is looked up, so it does not
+   * matter if later fonts evict earlier ones from the cache.  */
+  for (i = 0; i < fontCount; ++i)
+    {
+      struct SERVER_Font request;
+      struct FONT_Data *font;
+      unsigned int index;
+      char name[256];
+
+      if (-1 == (result = server_GetFont (reader, &request, name)))
+        goto done;
+
+      if (!(font = server_LoadFont (&request)))
+        {
+          result = server_Fail ("Failed to load font `%s' of size %u, weight %u",
+                                request.name, request.size, request.weight);
+
+          goto done;
+        }
+
+      index = GLYPH_AddFont (font);
+
+      for (j = 0; j < options->codeCount; ++j)
+        {
+          switch (GLYPH_Load (index, font, options->codes[j]))
+            {
+            case GLYPH_RENDER_FAILED:
+
+              result = server_Fail ("Failed to get glyph for character %u of `%s'",
+                                    options->codes[j], request.name);
+
+              goto done;
+
+            case GLYPH_ATLAS_FULL:
+
+              result = server_Fail ("Atlas is full: No room for character %u of `%s'",
+                                    options->codes[j], request.name);
+
+              goto done;
+            }
+        }
+    }
+
+  GLYPH_Export (options->format, stream);
+
+done:
+
+  if (fclose (stream))
+    err (EXIT_FAILURE, "Failed to export atlas");
+
+  if (!result)
+    server_Append (output, data, size);
+
+  free (data);
+
+  return result;
+}
+
+static int
+server_GetGlyph (struct server_Reader *reader, struct server_Buffer *output)
+{
+  struct SERVER_Font request;
+  struct FONT_Data *font;
+  struct FONT_Glyph *glyph;
+  char name[256];
+  uint32_t code;
+
+  if (-1 == server_GetFont (reader, &request, name))
+    return -1;
+
+  code = server_GetU32 (reader);
+
+  if (reader->overflow)
+    return server_Fail ("Truncated glyph request");
+
+  if (!(font = server_LoadFont (&request)))
+    return server_Fail ("Failed to load font `%s' of size %u, weight %u",
+                        request.name, request.size, request.weight);
+
+  if (!(glyph = FONT_GlyphForCharacter (font, code)))
+    return server_Fail ("Failed to get glyph for character %u of `%s'",
+                        code, request.name);
+
+  server_PutU16 (output, glyph->width);
+  server_PutU16 (output, glyph->height);
+  server_PutU16 (output, glyph->x);
+  server_PutU16 (output, glyph->y);
+  server_PutU16 (output, glyph->xOffset);
+  server_PutU16 (output, glyph->yOffset);
+  server_PutU32 (output, glyph->xAdvance);
+  server_Append (output, glyph->data, glyph->width * glyph->height * 4);
+
+  free (glyph);
+
+  return 0;
+}
+
+/* Appends the reply to one request to `output' */
+static void
+server_HandleRequest (const uint8_t *data, size_t size,
+                      struct server_Buffer *output)
+{
+  struct server_Reader reader;
+  struct timespec start, end;
+  size_t messageStart;
+  uint8_t status = SERVER_OK;
+  int result;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  memset (&reader, 0, sizeof (reader));
+  reader.data = data + 1;
+  reader.size = size - 1;
+
+  server_fontsUsed = 0;
+  server_fontsLoaded = 0;
+
+  /* The length is filled in once the reply is complete */
+  messageStart = output->size;
+  server_PutU32 (output, 0);
+  server_Append (output, &status, 1);
+
+  switch (data[0])
+    {
+    case SERVER_ATLAS:
+
+      result = server_BuildAtlas (&reader, output);
+
+      break;
+
+    case SERVER_GLYPH:
+
+      result = server_GetGlyph (&reader, output);
+
+      break;
+
+    default:
+
+      result = server_Fail ("Unknown request type %u", data[0]);
+    }
+
+  if (result)
+    {
+      output->size = messageStart + 4;
+      status = SERVER_ERROR;
+      server_Append (output, &status, 1);
+      server_Append (output, server_error, strlen (server_error));
+    }
+
+  server_FinishMessage (output, messageStart);
+
+  if (server_options->verbose)
+    {
+      clock_gettime (CLOCK_MONOTONIC, &end);
+
+      fprintf (stderr, "%c request: %.3f ms, %u fonts (%u loaded), %zu byte reply%s%s\n",
+               data[0],
+               (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) * 1e-6,
+               server_fontsUsed, server_fontsLoaded,
+               output->size - messageStart - 4,
+               result ? ": " : "", result ? server_error : "");
+    }
+}
+
+/* Answers every complete request received so far.  Returns -1 if the
+ * client sent a malformed message.  */
+static int
+server_ProcessInput (struct server_Client *client)
+{
+  size_t offset = 0;
+
+  while (client->input.size - offset >= 4
+         && client->output.size - client->outputOffset < SERVER_MAX_BACKLOG)
+    {
+      uint32_t length;
+
+      length = server_GetU32Bytes (client->input.data + offset);
+
+      if (!length || length > SERVER_MAX_REQUEST)
+        return -1;
+
+      if (client->input.size - offset - 4 < length)
+        break;
+
+      server_HandleRequest (client->input.data + offset + 4, length, &client->output);
+      offset += 4 + length;
+    }
+
+  memmove (client->input.data, client->input.data + offset,
+           client->input.size - offset);
+  client->input.size -= offset;
+
+  return 0;
+}
+
+static void
+server_CloseClient (struct server_Client *client)
+{
+  close (client->fd);
+  free (client->input.data);
+  free (client->output.data);
+
+  memset (client, 0, sizeof (*client));
+  client->fd = -1;
+}
+
+/* Sends pending output.  Returns -1 if the connection is gone.  */
+static int
+server_WriteOutput (struct server_Client *client)
+{
+  while (client->outputOffset < client->output.size)
+    {
+      ssize_t result;
+
+      result = write (client->fd, client->output.data + client->outputOffset,
+                      client->output.size - client->outputOffset);
+
+      if (result < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+      client->outputOffset += result;
+    }
+
+  client->output.size = 0;
+  client->outputOffset = 0;
+
+  return 0;
+}
+
+static int
+server_ReadInput (struct server_Client *client)
+{
+  uint8_t buffer[65536];
+  ssize_t result;
+
+  if (0 >= (result = read (client->fd, buffer, sizeof (buffer))))
+    return (result < 0 && (errno == EINTR || errno == EAGAIN)) ? 0 : -1;
+
+  server_Append (&client->input, buffer, result);
+
+  if (server_ProcessInput (client))
+    return -1;
+
+  return server_WriteOutput (client);
+}
+
+static int
+server_Listen (const char *path)
+{
+  struct sockaddr_un address;
+  struct stat st;
+  int fd;
+
+  if (strlen (path) >= sizeof (address.sun_path))
+    errx (EXIT_FAILURE, "Socket path `%s' is too long", path);
+
+  memset (&address, 0, sizeof (address));
+  address.sun_family = AF_UNIX;
+  strcpy (address.sun_path, path);
+
+  /* Replace the socket of a previous server, but nothing else */
+  if (!stat (path, &st) && S_ISSOCK (st.st_mode))
+    unlink (path);
+
+  if (-1 == (fd = socket (AF_UNIX, SOCK_STREAM, 0)))
+    err (EXIT_FAILURE, "Failed to create socket");
+
+  if (-1 == bind (fd, (struct sockaddr *) &address, sizeof (address)))
+    err (EXIT_FAILURE, "Failed to bind to `%s'", path);
+
+  if (-1 == listen (fd, 16))
+    err (EXIT_FAILURE, "Failed to listen on `%s'", path);
+
+  return fd;
+}
+
+void
+SERVER_Run (const char *path, const struct SERVER_Options *options)
+{
+  struct server_Client clients[SERVER_MAX_CLIENTS];
+  struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+  int listenFd;
+  unsigned int i;
+
+  server_options = options;
+
+  if (!(server_fonts = calloc (options->maxFonts, sizeof (*server_fonts))))
+    err (EXIT_FAILURE, "Failed to allocate font cache");
+
+  /* Clients that disconnect early must not terminate the server */
+  signal (SIGPIPE, SIG_IGN);
+
+  listenFd = server_Listen (path);
+
+  for (i = 0; i < SERVER_MAX_CLIENTS; ++i)
+    {
+      memset (&clients[i], 0, sizeof (clients[i]));
+      clients[i].fd = -1;
+    }
+
+  for (;;)
+    {
+      fds[0].fd = listenFd;
+      fds[0].events = POLLIN;
+
+      for (i = 0; i < SERVER_MAX_CLIENTS; ++i)
+        {
+          struct server_Client *client = &clients[i];
+
+          fds[i + 1].fd = client->fd;
+          fds[i + 1].events = 0;
+
+          if (client->output.size > client->outputOffset)
+            fds[i + 1].events |= POLLOUT;
+
+          if (client->output.size - client->outputOffset < SERVER_MAX_BACKLOG)
+            fds[i + 1].events |= POLLIN;
+        }
+
+      if (-1 == poll (fds, SERVER_MAX_CLIENTS + 1, -1))
+        {
+          if (errno == EINTR)
+            continue;
+
+          err (EXIT_FAILURE, "poll failed");
+        }
+
+      for (i = 0; i < SERVER_MAX_CLIENTS; ++i)
+        {
+          struct server_Client *client = &clients[i];
+          short revents = fds[i + 1].revents;
+
+          if (client->fd == -1 || !revents)
+            continue;
+
+          if (((revents & POLLOUT) && server_WriteOutput (client))
+              || ((revents & (POLLIN | POLLHUP | POLLERR)) && server_ReadInput (client)))
+            {
+              server_CloseClient (client);
+
+              continue;
+            }
+
+          /* Requests held back while the backlog drained */
+          if (client->input.size && (server_ProcessInput (client) || server_WriteOutput (client)))
+            server_CloseClient (client);
+        }
+
+      if (fds[0].revents & POLLIN)
+        {
+          int fd;
+
+          if (-1 == (fd = accept (listenFd, NULL, NULL)))
+            continue;
+
+          for (i = 0; i < SERVER_MAX_CLIENTS && clients[i].fd != -1; ++i)
+            ;
+
+          if (i == SERVER_MAX_CLIENTS)
+            {
+              close (fd);
+
+              continue;
+            }
+
+          fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+          clients[i].fd = fd;
+        }
+    }
+}
+
+int
+SERVER_Connect (const char *path)
+{
+  struct sockaddr_un address;
+  int fd;
+
+  if (strlen (path) >= sizeof (address.sun_path))
+    errx (EXIT_FAILURE, "Socket path `%s' is too long", path);
+
+  memset (&address, 0, sizeof (address));
+  address.sun_family = AF_UNIX;
+  strcpy (address.sun_path, path);
+
+  if (-1 == (fd = socket (AF_UNIX, SOCK_STREAM, 0)))
+    err (EXIT_FAILURE, "Failed to create socket");
+
+  if (-1 == connect (fd, (struct sockaddr *) &address, sizeof (address)))
+    err (EXIT_FAILURE, "Failed to connect to `%s'", path);
+
+  return fd;
+}
+
+static void
+server_WriteAll (int fd, const void *data, size_t size)
+{
+  const uint8_t *bytes = data;
+
+  while (size)
+    {
+      ssize_t result;
+
+      if (0 > (result = write (fd, bytes, size)))
+        {
+          if (errno == EINTR)
+            continue;
+
+          err (EXIT_FAILURE, "Failed to send request");
+        }
+
+      bytes += result;
+      size -= result;
+    }
+}
+
+static void
+server_ReadAll (int fd, void *data, size_t size)
+{
+  uint8_t *bytes = data;
+
+  while (size)
+    {
+      ssize_t result;
+
+      if (0 >= (result = read (fd, bytes, size)))
+        {
+          if (result < 0 && errno == EINTR)
+            continue;
+
+          if (result)
+            err (EXIT_FAILURE, "Failed to read reply");
+
+          errx (EXIT_FAILURE, "Server closed the connection");
+        }
+
+      bytes += result;
+      size -= result;
+    }
+}
+
+void
+SERVER_SendAtlasRequest (int fd, unsigned int atlasSize,
+                         const struct SERVER_Font *fonts, size_t count)
+{
+  struct server_Buffer buffer;
+  uint8_t type = SERVER_ATLAS;
+  size_t i;
+
+  memset (&buffer, 0, sizeof (buffer));
+
+  server_PutU32 (&buffer, 0);
+  server_Append (&buffer, &type, 1);
+  server_PutU16 (&buffer, atlasSize);
+  server_PutU16 (&buffer, count);
+
+  for (i = 0; i < count; ++i)
+    server_PutFont (&buffer, &fonts[i]);
+
+  server_FinishMessage (&buffer, 0);
+  server_WriteAll (fd, buffer.data, buffer.size);
+
+  free (buffer.data);
+}
+
+void
+SERVER_SendGlyphRequest (int fd, const struct SERVER_Font *font, uint32_t code)
+{
+  struct server_Buffer buffer;
+  uint8_t type = SERVER_GLYPH;
+
+  memset (&buffer, 0, sizeof (buffer));
+
+  server_PutU32 (&buffer, 0);
+  server_Append (&buffer, &type, 1);
+  server_PutFont (&buffer, font);
+  server_PutU32 (&buffer, code);
+
+  server_FinishMessage (&buffer, 0);
+  server_WriteAll (fd, buffer.data, buffer.size);
+
+  free (buffer.data);
+}
+
+enum SERVER_Status
+SERVER_ReadResponse (int fd, uint8_t **payload, size_t *size)
+{
+  uint8_t header[5];
+
+  server_ReadAll (fd, header, sizeof (header));
+
+  if (!(*size = server_GetU32Bytes (header)))
+    errx (EXIT_FAILURE, "Malformed reply");
+
+  --*size;
+
+  /* One extra byte so error messages can be NUL terminated */
+  if (!(*payload = malloc (*size + 1)))
+    err (EXIT_FAILURE, "Failed to allocate %zu byte reply", *size);
+
+  server_ReadAll (fd, *payload, *size);
+  (*payload)[*size] = 0;
+
+  return header[4];
+}
@@ -0,0 +1,80 @@
+#ifndef SERVER_H_
+#define SERVER_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compress.h"
+#include "mipmap.h"
+
+/* Every message is a little endian 32-bit length, followed by that many
+ * bytes: a type or status byte, then the payload.
+
+     SERVER_ATLAS  U16 atlas size (0 for the server default, which is also
+                   the largest allowed), U16 font count, then per font U16
+                   size, U16 weight, U16 name length, name.
+                   The reply is an atlas in the server's export format.
+
+     SERVER_GLYPH  U16 size, U16 weight, U16 name length, name, U32 code.
+                   The reply is U16 width, U16 height, S16 x, y, xOffset
+                   and yOffset, S32 xAdvance (26.6), then width * height
+                   RGBA pixels.
+
+   Requests may be pipelined, and are answered in order.  Replies start
+   with SERVER_OK, or SERVER_ERROR followed by a message.  */
+enum SERVER_Type
+{
+  SERVER_ATLAS = 'A',
+  SERVER_GLYPH = 'G'
+};
+
+enum SERVER_Status
+{
+  SERVER_OK = 0,
+  SERVER_ERROR = 1
+};
+
+struct SERVER_Font
+{
+  const char *name;
+  unsigned int size, weight;
+};
+
+/* Settings shared by every atlas the server builds */
+struct SERVER_Options
+{
+  unsigned int atlasSize; /* default and largest atlas size */
+  unsigned int subpixelPositions;
+  const char *format;
+  enum COMPRESS_Format pixelFormat;
+  unsigned int mipLevels;
+  enum MIPMAP_Filter mipFilter;
+
+  const uint32_t *codes;
+  size_t codeCount;
+
+  unsigned int maxFonts; /* loaded fonts kept between requests */
+  int verbose;
+};
+
+/* Answers requests on the Unix socket `path' until killed.  FONT_Init must
+ * have been called.  */
+void
+SERVER_Run (const char *path, const struct SERVER_Options *options);
+
+int
+SERVER_Connect (const char *path);
+
+void
+SERVER_SendAtlasRequest (int fd, unsigned int atlasSize,
+                         const struct SERVER_Font *fonts, size_t count);
+
+void
+SERVER_SendGlyphRequest (int fd, const struct SERVER_Font *font, uint32_t code);
+
+/* Reads the next reply and returns its status.  The payload is allocated
+ * with malloc.  */
+enum SERVER_Status
+SERVER_ReadResponse (int fd, uint8_t **payload, size_t *size);
+
+#endif /* !SERVER_H_ */
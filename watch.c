@@ -0,0 +1,213 @@
+/*
+  File change notification
+  Copyright (C) 2012  Morten Hustveit <morten.hustveit@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#define _POSIX_C_SOURCE 200809L
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "watch.h"
+
+/* Events that mean a file in a watched directory has new contents */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE)
+
+struct watch_File
+{
+  int wd; /* of the directory */
+  char *name;
+  unsigned int owner;
+};
+
+static int watch_fd = -1;
+
+static struct watch_File *watch_files;
+static size_t watch_fileCount, watch_fileAlloc;
+
+void
+WATCH_Add (const char *path, unsigned int owner)
+{
+  struct watch_File *file;
+  const char *name;
+  char *directory;
+  size_t i;
+  int wd;
+
+  if (watch_fd == -1 && -1 == (watch_fd = inotify_init ()))
+    err (EXIT_FAILURE, "Failed to initialize inotify");
+
+  if ((name = strrchr (path, '/')))
+    {
+      directory = strndup (path, (name == path) ? 1 : (size_t) (name - path));
+      ++name;
+    }
+  else
+    {
+      directory = strdup (".");
+      name = path;
+    }
+
+  if (!directory)
+    err (EXIT_FAILURE, "Failed to allocate path");
+
+  /* Watching a directory twice returns the same descriptor */
+  wd = inotify_add_watch (watch_fd, directory, WATCH_EVENTS);
+
+  if (wd == -1)
+    {
+      warn ("Failed to watch `%s'", directory);
+      free (directory);
+
+      return;
+    }
+
+  free (directory);
+
+  for (i = 0; i < watch_fileCount; ++i)
+    {
+      if (watch_files[i].wd == wd && watch_files[i].owner == owner
+          && !strcmp (watch_files[i].name, name))
+        return;
+    }
+
+  if (watch_fileCount == watch_fileAlloc)
+    {
+      watch_fileAlloc = watch_fileAlloc ? watch_fileAlloc * 2 : 16;
+
+      if (!(watch_files = realloc (watch_files, watch_fileAlloc * sizeof (*watch_files))))
+        err (EXIT_FAILURE, "Failed to allocate watch list");
+    }
+
+  file = &watch_files[watch_fileCount++];
+  file->wd = wd;
+  file->owner = owner;
+
+  if (!(file->name = strdup (name)))
+    err (EXIT_FAILURE, "Failed to allocate path");
+}
+
+void
+WATCH_Remove (unsigned int owner)
+{
+  size_t i, j;
+
+  /* Directory watches are kept, as other files may share them */
+  for (i = 0, j = 0; i < watch_fileCount; ++i)
+    {
+      if (watch_files[i].owner == owner)
+        free (watch_files[i].name);
+      else
+        watch_files[j++] = watch_files[i];
+    }
+
+  watch_fileCount = j;
+}
+
+/* Reads pending events, and returns non-zero if any concerned a watched
+ * file */
+static int
+watch_ReadEvents (unsigned char *changed, unsigned int ownerCount)
+{
+  union
+  {
+    struct inotify_event event;
+    char data[4096];
+  } buffer;
+  const char *p;
+  ssize_t length;
+  size_t i;
+  int result = 0;
+
+  while (-1 == (length = read (watch_fd, &buffer, sizeof (buffer))))
+    {
+      if (errno != EINTR)
+        err (EXIT_FAILURE, "Failed to read inotify events");
+    }
+
+  for (p = buffer.data; p < buffer.data + length;
+       p += sizeof (struct inotify_event) + ((const struct inotify_event *) p)->len)
+    {
+      const struct inotify_event *event = (const struct inotify_event *) p;
+
+      /* Events were lost, so anything may have changed */
+      if (event->mask & IN_Q_OVERFLOW)
+        {
+          memset (changed, 1, ownerCount);
+
+          return 1;
+        }
+
+      if (!event->len)
+        continue;
+
+      for (i = 0; i < watch_fileCount; ++i)
+        {
+          if (watch_files[i].wd != event->wd
+              || watch_files[i].owner >= ownerCount
+              || strcmp (watch_files[i].name, event->name))
+            continue;
+
+          changed[watch_files[i].owner] = 1;
+          result = 1;
+        }
+    }
+
+  return result;
+}
+
+void
+WATCH_Wait (unsigned char *changed, unsigned int ownerCount, int quietMs)
+{
+  struct pollfd pfd;
+
+  if (watch_fd == -1)
+    errx (EXIT_FAILURE, "No files are being watched");
+
+  while (!watch_ReadEvents (changed, ownerCount))
+    ;
+
+  /* Saving a file often takes several events */
+  pfd.fd = watch_fd;
+  pfd.events = POLLIN;
+
+  for (;;)
+    {
+      int ready;
+
+      if (-1 == (ready = poll (&pfd, 1, quietMs)))
+        {
+          if (errno == EINTR)
+            continue;
+
+          err (EXIT_FAILURE, "Failed to wait for inotify events");
+        }
+
+      if (!ready)
+        break;
+
+      watch_ReadEvents (changed, ownerCount);
+    }
+}
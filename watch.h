@@ -0,0 +1,21 @@
+#ifndef WATCH_H_
+#define WATCH_H_ 1
+
+/* Files are watched through their directories, so that a file replaced by
+ * renaming another over it, as many editors do, is still noticed.  */
+
+/* Starts watching `path'.  Changes to it are reported for `owner'.  */
+void
+WATCH_Add (const char *path, unsigned int owner);
+
+/* Stops watching the files of `owner' */
+void
+WATCH_Remove (unsigned int owner);
+
+/* Waits until a watched file changes, then until no more changes have
+ * arrived for `quietMs' milliseconds.  Sets changed[owner] for the owner
+ * of every file that changed.  */
+void
+WATCH_Wait (unsigned char *changed, unsigned int ownerCount, int quietMs);
+
+#endif /* !WATCH_H_ */